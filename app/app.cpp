@@ -2,24 +2,34 @@
 
 #include <main.h>
 
-#include "app/can/can.hpp"
+#include "app/can/scheduler.hpp"
+#include "app/event.hpp"
+#include "app/interfaces.hpp"
+#include "app/interrupt_priority.hpp"
+#include "app/logger/trace.hpp"
 #include "app/spi/bmi088/accel.hpp"
 #include "app/spi/bmi088/gyro.hpp"
-#include "app/uart/uart.hpp"
+#include "app/timer/profiler.hpp"
 #include "app/usb/cdc.hpp"
+#include "utility/crc_unit.hpp"
 
 extern "C" {
 void AppEntry() { app.init().main(); }
+
+// Called from the USER CODE section of SysTick_Handler, after HAL_IncTick.
+void systick_irq_handler() { event::signal(event::TICK); }
 }
 
 App::App() {
+    interrupt_priority::apply();
+    timer::profiler::init();
+    utility::crc::self_check();
+    utility::crc::report_benchmark();
+    logger::trace::init();
     led::led.init();
     usb::cdc.init();
-    can::can1.init();
-    can::can2.init();
-    uart::uart1.init();
-    uart::uart2.init();
-    uart::uart_dbus.init();
+    interfaces::init();
+    can::scheduler.init();
     spi::bmi088::accelerometer.init();
     spi::bmi088::gyroscope.init();
     __enable_irq();
@@ -27,15 +37,22 @@ App::App() {
 
 [[noreturn]] void App::main() {
     while (true) {
+        auto sources = event::wait();
+        if (sources & event::TICK)
+            timer::profiler::report_if_due();
+        timer::profiler::Scope profile{timer::profiler::Point::MAIN_LOOP};
+
+        // Every consumer runs on TICK, for its timeouts and reports. A packet blocked by a full
+        // queue is resumed on DOWNLINK, signalled as the queues drain.
+        if (sources & (event::USB_RECEIVE | event::DOWNLINK | event::TICK))
+            if (usb::cdc->try_receive())
+                sources |= event::DOWNLINK;
         usb::cdc->try_transmit();
-        can::can1->try_transmit();
-        usb::cdc->try_transmit();
-        can::can2->try_transmit();
-        usb::cdc->try_transmit();
-        uart::uart1->try_transmit();
-        usb::cdc->try_transmit();
-        uart::uart2->try_transmit();
-        usb::cdc->try_transmit();
-        uart::uart_dbus->try_transmit();
+        if (sources & (event::DOWNLINK | event::TICK)) {
+            interfaces::for_each([](auto& interface) {
+                interface.try_transmit();
+                usb::cdc->try_transmit();
+            });
+        }
     }
 }
\ No newline at end of file
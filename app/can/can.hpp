@@ -4,55 +4,64 @@
 #include <cstdint>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
 #include <can.h>
 
+#include "app/can/scheduler.hpp"
+#include "app/event.hpp"
+#include "app/logger/trace.hpp"
+#include "app/timer/profiler.hpp"
+#include "app/usb/cdc.hpp"
 #include "app/usb/field.hpp"
 #include "app/usb/interrupt_safe_buffer.hpp"
 #include "utility/assert.hpp"
 #include "utility/immovable.hpp"
+#include "utility/interrupt_lock.hpp"
 #include "utility/lazy.hpp"
 #include "utility/ring_buffer.hpp"
 
+namespace interfaces {
+template <IRQn_Type irqn>
+void handle_interrupt();
+}
+
 namespace can {
 
 class Can : private utility::Immovable {
 public:
-    using Lazy = utility::Lazy<Can, CAN_HandleTypeDef*, uint32_t, uint32_t>;
+    // Peripheral resources of one bus, listed in app/interfaces.hpp.
+    struct Config {
+        CAN_HandleTypeDef* hal_can_handle;
+        usb::field::UplinkId uplink_field_id;
+        uint32_t hal_filter_bank, hal_slave_start_filter_bank;
+        IRQn_Type receive_irqn, transmit_irqn;
+    };
+
+    using Lazy = utility::Lazy<Can, Config>;
 
-    Can(CAN_HandleTypeDef* hal_can_handle, uint32_t hal_filter_bank,
-        uint32_t hal_slave_start_filter_bank)
-        : hal_can_handle_(hal_can_handle) {
-        config_can(hal_filter_bank, hal_slave_start_filter_bank);
+    explicit Can(const Config& config)
+        : hal_can_handle_(config.hal_can_handle)
+        , uplink_field_id_(config.uplink_field_id)
+        , default_bit_timing_(
+              config.hal_can_handle->Instance->BTR & ~(CAN_BTR_LBKM | CAN_BTR_SILM)) {
+        status_.can_field_id = static_cast<uint8_t>(uplink_field_id_);
+        reported_status_     = status_;
+        config_can(config);
+    }
+
+    // The bus stays off until the host configures a finite delay.
+    static constexpr uint16_t manual_bus_off_recovery = 0xFFFF;
+
+    // Set the time to wait in bus-off state before the controller is restarted.
+    void set_bus_off_recovery_delay(uint16_t milliseconds) {
+        bus_off_recovery_delay_.store(milliseconds, std::memory_order::relaxed);
     }
 
     bool read_buffer_write_device(std::byte*& buffer) {
-        auto construct = [&buffer](std::byte* storage) {
-            auto& mailbox = *new (storage) TransmitMailboxData{};
-
-            auto& header = *std::launder(reinterpret_cast<const FieldHeader*>(buffer));
-            buffer += sizeof(header);
-
-            uint8_t can_data_length;
-            if (header.is_extended_can_id) {
-                auto& ext_id = *std::launder(reinterpret_cast<const CanExtendedId*>(buffer));
-                buffer += sizeof(ext_id);
-                mailbox.identifier = (ext_id.can_id << CAN_TI0R_EXID_Pos) | CAN_ID_EXT;
-                can_data_length    = header.has_can_data ? ext_id.data_length + 1 : 0;
-            } else [[likely]] {
-                auto& std_id = *std::launder(reinterpret_cast<const CanStandardId*>(buffer));
-                buffer += sizeof(std_id);
-                mailbox.identifier = (std_id.can_id << CAN_TI0R_STID_Pos) | CAN_ID_STD;
-                can_data_length    = header.has_can_data ? std_id.data_length + 1 : 0;
-            }
-            mailbox.identifier |= header.is_remote_transmission ? CAN_RTR_REMOTE : CAN_RTR_DATA;
-            mailbox.identifier |= CAN_TI0R_TXRQ;
-            mailbox.data_length_and_timestamp = can_data_length;
-
-            // Always read full 8 bytes to reduce the number of if-branches for performance
-            // considerations (almost all CAN messages have a length of 8 bytes).
-            std::memcpy(mailbox.data, buffer, 8);
-            buffer += can_data_length;
-        };
+        auto construct = [&buffer](std::byte* storage) { construct_mailbox_data(buffer, storage); };
 
         if (transmit_buffer_.emplace_back_multi(construct, 1)) [[likely]] {
             return true;
@@ -64,38 +73,425 @@ public:
         }
     }
 
+    // Size of the downlink CAN field at buffer, or 0 if it exceeds the available bytes.
+    static size_t downlink_field_size(const std::byte* buffer, size_t available) {
+        if (available < sizeof(FieldHeader) + sizeof(CanStandardId))
+            return 0;
+
+        auto& header = *std::launder(reinterpret_cast<const FieldHeader*>(buffer));
+        buffer += sizeof(FieldHeader);
+
+        size_t size = sizeof(FieldHeader);
+        uint8_t data_length;
+        if (header.is_extended_can_id) {
+            size += sizeof(CanExtendedId);
+            if (available < size)
+                return 0;
+            data_length = std::launder(reinterpret_cast<const CanExtendedId*>(buffer))->data_length;
+        } else [[likely]] {
+            size += sizeof(CanStandardId);
+            data_length = std::launder(reinterpret_cast<const CanStandardId*>(buffer))->data_length;
+        }
+        if (header.has_can_data)
+            size += data_length + 1;
+
+        return size <= available ? size : 0;
+    }
+
+    // Check whether the field at buffer can be forwarded without being dropped.
+    bool device_writeable(const std::byte*) const { return transmit_buffer_.writeable(); }
+
+    static constexpr size_t periodic_slot_count = 8;
+    static constexpr uint32_t no_periodic_frame = 0xFFFFFFFF;
+
+    // Read a downlink CAN field from buffer as the frame of a periodic slot, first transmitted
+    // after phase and then every period (both in microseconds). A period of 0 clears the slot, in
+    // which case no CAN field follows.
+    void set_periodic_frame(
+        std::byte*& buffer, size_t slot_index, uint32_t period, uint32_t phase) {
+        assert(slot_index < periodic_slot_count);
+
+        alignas(TransmitMailboxData) std::byte storage[sizeof(TransmitMailboxData)]{};
+        auto& frame = *new (storage) TransmitMailboxData{};
+        if (period) {
+            construct_mailbox_data(buffer, storage);
+            frame.retry_budget = 0;
+        }
+
+        utility::InterruptLockGuard guard;
+        auto& slot    = periodic_slots_[slot_index];
+        slot.frame    = frame;
+        slot.period   = period;
+        slot.next_due = Scheduler::now() + phase;
+        Scheduler::reschedule();
+    }
+
+    // Data length of the frame in a periodic slot, which its patches must match.
+    size_t periodic_frame_length(size_t slot_index) const {
+        assert(slot_index < periodic_slot_count);
+        auto& slot = periodic_slots_[slot_index];
+        return (slot.frame.data_length_and_timestamp & CAN_TDT0R_DLC) >> CAN_TDT0R_DLC_Pos;
+    }
+
+    // Replace the payload of a periodic slot in place, the data length of the slot is kept. Return
+    // false if the slot is cleared, its payload is skipped in that case.
+    bool patch_periodic_frame(std::byte*& buffer, size_t slot_index) {
+        assert(slot_index < periodic_slot_count);
+
+        auto& slot    = periodic_slots_[slot_index];
+        size_t length = periodic_frame_length(slot_index);
+        bool active   = slot.period;
+        if (active) {
+            utility::InterruptLockGuard guard;
+            std::memcpy(slot.frame.data, buffer, length);
+        }
+        buffer += length;
+        return active;
+    }
+
+    void clear_periodic_frames() {
+        utility::InterruptLockGuard guard;
+        for (auto& slot : periodic_slots_)
+            slot.period = 0;
+    }
+
+    // Called by the scheduler interrupt: load every periodic frame that is due into a mailbox, or
+    // queue it for the main loop if none is free. Return the time until the next one is due, or
+    // no_periodic_frame if the table is empty.
+    uint32_t transmit_periodic(uint32_t now) {
+        uint32_t min_delay = no_periodic_frame;
+
+        for (auto& slot : periodic_slots_) {
+            if (!slot.period)
+                continue;
+
+            if (static_cast<int32_t>(slot.next_due - now) <= 0) {
+                if (periodic_buffer_.readable() || !transmit_immediately(slot.frame)) [[unlikely]]
+                    if (!periodic_buffer_.emplace_back(slot.frame)) [[unlikely]]
+                        led::led->downlink_buffer_full();
+                // Skip missed periods to keep the phase.
+                do {
+                    slot.next_due += slot.period;
+                } while (static_cast<int32_t>(slot.next_due - now) <= 0);
+            }
+            min_delay = std::min(min_delay, slot.next_due - now);
+        }
+
+        return min_delay;
+    }
+
+    // Request a new bit timing, which is applied from the main loop without touching the filter
+    // banks or the other bus. Return false if the bitrate (bit/s) and sample point (per mille)
+    // can not be achieved with the current peripheral clock.
+    bool set_bit_timing(uint32_t bitrate, uint16_t sample_point) {
+        auto btr = calculate_bit_timing(bitrate, sample_point);
+        if (!btr)
+            return false;
+        pending_bit_timing_.store(btr, std::memory_order::relaxed);
+        return true;
+    }
+
+    // Restore the bit timing configured at startup.
+    void reset_bit_timing() {
+        pending_bit_timing_.store(default_bit_timing_, std::memory_order::relaxed);
+    }
+
+    struct BridgeRule {
+        Can* target; // nullptr if the rule is unused
+        bool is_extended_can_id;
+        bool forward_to_host;
+        uint32_t match_id, match_mask;     // Matches if ((can_id ^ match_id) & match_mask) == 0
+        uint32_t rewrite_id, rewrite_mask; // Bits of can_id in rewrite_mask are from rewrite_id
+    };
+    static constexpr size_t bridge_rule_count = 8;
+
+    // Set a rule to forward frames received by this bus directly to the target bus.
+    void set_bridge_rule(size_t index, const BridgeRule& rule) {
+        assert(index < bridge_rule_count);
+        utility::InterruptLockGuard guard;
+        bridge_rules_[index] = rule;
+    }
+
+    void clear_bridge_rules() {
+        utility::InterruptLockGuard guard;
+        for (auto& rule : bridge_rules_)
+            rule.target = nullptr;
+    }
+
     bool try_transmit() {
+        timer::profiler::Scope profile{timer::profiler::Point::CAN_TRANSMIT};
         auto hcan = hal_can_handle_;
 
         auto state = hcan->State;
-        assert_always((state == HAL_CAN_STATE_READY) || (state == HAL_CAN_STATE_LISTENING));
+        if ((state != HAL_CAN_STATE_READY) && (state != HAL_CAN_STATE_LISTENING)) [[unlikely]]
+            return false;
 
-        uint32_t tsr = hcan->Instance->TSR;
-        auto free_mailbox_count =
-            !!(tsr & CAN_TSR_TME0) + !!(tsr & CAN_TSR_TME1) + !!(tsr & CAN_TSR_TME2);
+        if (auto btr = pending_bit_timing_.exchange(0, std::memory_order::relaxed)) [[unlikely]]
+            apply_bit_timing(btr);
 
-        return transmit_buffer_.pop_front_multi(
-            [this, hcan](TransmitMailboxData&& mailbox_data) {
-                auto target_mailbox_index =
-                    (hcan->Instance->TSR & CAN_TSR_CODE) >> CAN_TSR_CODE_Pos;
-                assert_always(target_mailbox_index <= 2);
+        monitor_errors();
 
-                auto& target_mailbox = hal_can_handle_->Instance->sTxMailBox[target_mailbox_index];
-                target_mailbox.TDTR  = mailbox_data.data_length_and_timestamp;
-                target_mailbox.TDLR  = mailbox_data.data[0];
-                target_mailbox.TDHR  = mailbox_data.data[1];
-                target_mailbox.TIR   = mailbox_data.identifier;
-            },
-            free_mailbox_count);
+        utility::InterruptLockGuard guard;
+        uint32_t free_mailboxes   = loadable_mailboxes(collect_transmit_status());
+        size_t free_mailbox_count = std::popcount(free_mailboxes);
+
+        auto transmit = [this, &free_mailboxes](TransmitMailboxData&& mailbox_data) {
+            load_mailbox(free_mailboxes, mailbox_data);
+        };
+
+        // Periodic frames go first, as they are already scheduled at their exact due time.
+        size_t count = periodic_buffer_.pop_front_multi(transmit, free_mailbox_count);
+        count += bridge_buffer_.pop_front_multi(transmit, free_mailbox_count - count);
+        count += transmit_buffer_.pop_front_multi(transmit, free_mailbox_count - count);
+        return count;
     }
 
 private:
-    friend void ::HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef*);
+    template <IRQn_Type irqn>
+    friend void interfaces::handle_interrupt();
+
+    // Called by CANx_RX0_IRQHandler in place of HAL_CAN_IRQHandler, FIFO 0 message pending is the
+    // only interrupt enabled on these lines.
+    void receive_irq_handler(usb::InterruptSafeBuffer& buffer_wrapper) {
+        timer::profiler::Scope profile{timer::profiler::Point::CAN_RECEIVE};
+        read_device_write_buffer(buffer_wrapper);
+    }
 
-    void config_can(uint32_t hal_filter_bank, uint32_t hal_slave_start_filter_bank) {
+    // Called by the transmit interrupt when a mailbox request completed. Failed reliable frames
+    // are retried right away, the main loop is woken up to refill the mailboxes from the queues,
+    // so it never has to poll them while they are busy or the bus is off.
+    void transmit_irq_handler() {
+        {
+            utility::InterruptLockGuard guard;
+            collect_transmit_status();
+        }
+        event::signal(event::DOWNLINK);
+    }
+
+    enum class ErrorState : uint8_t { ACTIVE = 0, WARNING = 1, PASSIVE = 2, BUS_OFF = 3 };
+
+    struct __attribute__((packed)) StatusField {
+        uint8_t field_id   : 4; // UplinkId::CONTROL_
+        uint8_t control_id : 4; // UplinkControlId::CAN_STATUS_
+
+        struct __attribute__((packed)) Status {
+            uint8_t can_field_id      : 4; // UplinkId of the reporting bus
+            ErrorState error_state    : 2;
+            uint8_t last_error_code   : 2; // LEC[1:0]
+            bool last_error_code_high : 1; // LEC[2], LEC 7 means no error since last report
+            uint8_t bus_off_count     : 7; // Wrapping
+            uint8_t transmit_error_counter;
+            uint8_t receive_error_counter;
+            uint8_t arbitration_lost_count[3]; // Per transmit mailbox, wrapping
+            uint8_t transmit_error_count[3];   // Per transmit mailbox, wrapping
+
+            bool operator==(const Status&) const = default;
+        } status;
+    };
+
+    struct __attribute__((packed)) TransmitFailedField {
+        uint8_t field_id        : 4; // UplinkId::CONTROL_
+        uint8_t control_id      : 4; // UplinkControlId::CAN_TRANSMIT_FAILED_
+        uint8_t can_field_id    : 4; // UplinkId of the reporting bus
+        bool is_extended_can_id : 1;
+        uint8_t reserved        : 3;
+        uint32_t can_id;
+    };
+
+    // Read and clear completion status of transmit mailboxes, retransmit failed reliable frames,
+    // return the TSR value after that. Like every mailbox access, called under the interrupt lock.
+    uint32_t collect_transmit_status() {
+        auto hal_can_instance = hal_can_handle_->Instance;
+
+        uint32_t tsr = hal_can_instance->TSR;
+        if (!(tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2))) [[likely]]
+            return tsr;
+
+        uint32_t clear_mask = 0;
+        for (int i = 0; i < 3; i++) {
+            const auto shift = 8 * i;
+            if (!(tsr & (CAN_TSR_RQCP0 << shift)))
+                continue;
+            clear_mask |= CAN_TSR_RQCP0 << shift;
+            if (tsr & (CAN_TSR_ALST0 << shift))
+                status_.arbitration_lost_count[i]++;
+            if (tsr & (CAN_TSR_TERR0 << shift))
+                status_.transmit_error_count[i]++;
+        }
+        // Writing RQCPx clears TXOKx, ALSTx and TERRx, other bits in TSR ignore zeros.
+        hal_can_instance->TSR = clear_mask;
+
+        for (int i = 0; i < 3; i++) {
+            const auto shift = 8 * i;
+            auto& reliable   = reliable_mailboxes_[i];
+            if (!(clear_mask & (CAN_TSR_RQCP0 << shift)) || !reliable.retry_budget)
+                continue;
+
+            if (tsr & (CAN_TSR_TXOK0 << shift)) {
+                reliable.retry_budget = 0;
+            } else if (--reliable.retry_budget) {
+                // The mailbox just became empty, and is reloaded before any queued frame.
+                write_mailbox(i, reliable);
+            } else {
+                report_transmit_failed(reliable.identifier);
+            }
+        }
+
+        return hal_can_instance->TSR;
+    }
+
+    void report_transmit_failed(uint32_t identifier) {
+        auto buffer = usb::cdc->get_transmit_buffer().allocate(sizeof(TransmitFailedField));
+        if (!buffer)
+            return;
+
+        constexpr auto control_id = usb::field::UplinkControlId::CAN_TRANSMIT_FAILED_;
+        bool is_extended_can_id   = identifier & CAN_ID_EXT;
+
+        auto& field              = *new (buffer) TransmitFailedField{};
+        field.field_id           = static_cast<uint8_t>(usb::field::UplinkId::CONTROL_);
+        field.control_id         = static_cast<uint8_t>(control_id);
+        field.can_field_id       = static_cast<uint8_t>(uplink_field_id_);
+        field.is_extended_can_id = is_extended_can_id;
+        if (is_extended_can_id)
+            field.can_id = ((CAN_TI0R_EXID | CAN_TI0R_STID) & identifier) >> CAN_TI0R_EXID_Pos;
+        else
+            field.can_id = (CAN_TI0R_STID & identifier) >> CAN_TI0R_STID_Pos;
+    }
+
+    void monitor_errors() {
+        auto hal_can_instance = hal_can_handle_->Instance;
+        uint32_t esr          = hal_can_instance->ESR;
+        uint32_t tick         = HAL_GetTick();
+
+        auto error_state = ErrorState::ACTIVE;
+        if (esr & CAN_ESR_BOFF)
+            error_state = ErrorState::BUS_OFF;
+        else if (esr & CAN_ESR_EPVF)
+            error_state = ErrorState::PASSIVE;
+        else if (esr & CAN_ESR_EWGF)
+            error_state = ErrorState::WARNING;
+
+        if (error_state == ErrorState::BUS_OFF) [[unlikely]] {
+            if (status_.error_state != ErrorState::BUS_OFF) {
+                status_.bus_off_count++;
+                bus_off_tick_       = tick;
+                bus_off_recovering_ = false;
+            }
+            auto delay = bus_off_recovery_delay_.load(std::memory_order::relaxed);
+            if (!bus_off_recovering_ && delay != manual_bus_off_recovery
+                && tick - bus_off_tick_ >= delay) {
+                // Restart only once, as restarting again would reset the recovery sequence.
+                restart_controller();
+                bus_off_recovering_ = true;
+            }
+        }
+
+        uint32_t lec                   = (esr & CAN_ESR_LEC) >> CAN_ESR_LEC_Pos;
+        status_.error_state            = error_state;
+        status_.last_error_code        = lec & 0b11;
+        status_.last_error_code_high   = lec >> 2;
+        status_.transmit_error_counter = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+        status_.receive_error_counter  = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+
+        // Report error state transitions immediately, other changes at a limited rate.
+        bool state_changed = error_state != reported_status_.error_state;
+        if (!state_changed && (status_ == reported_status_ || tick - report_tick_ < 100))
+            return;
+
+        auto buffer = usb::cdc->get_transmit_buffer().allocate(sizeof(StatusField));
+        if (!buffer)
+            return;
+
+        auto& field      = *new (buffer) StatusField{};
+        field.field_id   = static_cast<uint8_t>(usb::field::UplinkId::CONTROL_);
+        field.control_id = static_cast<uint8_t>(usb::field::UplinkControlId::CAN_STATUS_);
+        field.status     = status_;
+
+        reported_status_ = status_;
+        report_tick_     = tick;
+
+        // Let LEC indicate whether any new error occurs before the next report.
+        hal_can_instance->ESR = CAN_ESR_LEC;
+    }
+
+    // Return the BTR value (without mode bits) for the requested timing, or 0 if unachievable.
+    // Prefer more time quanta per bit among timings with equal sample point error.
+    static uint32_t calculate_bit_timing(uint32_t bitrate, uint16_t sample_point) {
+        if (!bitrate || bitrate > 1'000'000 || sample_point >= 1000)
+            return 0;
+
+        uint32_t clock      = HAL_RCC_GetPCLK1Freq();
+        uint32_t btr        = 0;
+        uint32_t best_error = 1000;
+
+        for (uint32_t time_quanta = 25; time_quanta >= 8; time_quanta--) {
+            if (clock % (bitrate * time_quanta))
+                continue;
+            uint32_t prescaler = clock / (bitrate * time_quanta);
+            if (prescaler < 1 || prescaler > 1024)
+                continue;
+
+            // The sample point lies after the sync segment and bit segment 1.
+            uint32_t sample_quanta = (sample_point * time_quanta + 500) / 1000;
+            uint32_t bs1           = sample_quanta - 1;
+            uint32_t bs2           = time_quanta - sample_quanta;
+            if (bs1 < 1 || bs1 > 16 || bs2 < 1 || bs2 > 8)
+                continue;
+
+            uint32_t actual = sample_quanta * 1000 / time_quanta;
+            uint32_t error  = actual > sample_point ? actual - sample_point : sample_point - actual;
+            if (error >= best_error)
+                continue;
+
+            uint32_t sjw = std::min<uint32_t>(bs2, 4);
+            best_error   = error;
+            btr          = ((prescaler - 1) << CAN_BTR_BRP_Pos) | ((bs1 - 1) << CAN_BTR_TS1_Pos)
+                | ((bs2 - 1) << CAN_BTR_TS2_Pos) | ((sjw - 1) << CAN_BTR_SJW_Pos);
+        }
+
+        return btr;
+    }
+
+    // BTR is writable only in initialization mode. Only this controller enters it, the filter
+    // banks (owned by CAN1 and shared with CAN2) live in a separate filter initialization mode and
+    // are left untouched, so the other bus keeps running.
+    void apply_bit_timing(uint32_t btr) {
+        auto hal_can_instance = hal_can_handle_->Instance;
+
+        // Every CONNECT requests the default timing, do not drop frames in flight for nothing.
+        if ((hal_can_instance->BTR & ~(CAN_BTR_LBKM | CAN_BTR_SILM)) == btr)
+            return;
+
+        // Initialization mode is entered after the ongoing frame completes.
+        hal_can_instance->MCR |= CAN_MCR_INRQ;
+        uint32_t start = HAL_GetTick();
+        while (!(hal_can_instance->MSR & CAN_MSR_INAK)) {
+            if (HAL_GetTick() - start > 10) {
+                hal_can_instance->MCR &= ~CAN_MCR_INRQ;
+                return;
+            }
+        }
+
+        hal_can_instance->BTR = (hal_can_instance->BTR & (CAN_BTR_LBKM | CAN_BTR_SILM)) | btr;
+        hal_can_instance->MCR &= ~CAN_MCR_INRQ;
+    }
+
+    // Request initialization mode and leave it immediately. The controller rejoins the bus after
+    // monitoring 128 occurrences of 11 recessive bits, without blocking the main loop.
+    void restart_controller() {
+        auto hal_can_instance = hal_can_handle_->Instance;
+
+        hal_can_instance->MCR |= CAN_MCR_INRQ;
+        for (int timeout = 1000; !(hal_can_instance->MSR & CAN_MSR_INAK) && timeout; timeout--)
+            ;
+        hal_can_instance->MCR &= ~CAN_MCR_INRQ;
+    }
+
+    void config_can(const Config& config) {
         CAN_FilterTypeDef sFilterConfig;
 
-        sFilterConfig.FilterBank           = hal_filter_bank;
+        sFilterConfig.FilterBank           = config.hal_filter_bank;
         sFilterConfig.FilterMode           = CAN_FILTERMODE_IDMASK;
         sFilterConfig.FilterScale          = CAN_FILTERSCALE_32BIT;
         sFilterConfig.FilterIdHigh         = 0x0000;
@@ -104,81 +500,128 @@ private:
         sFilterConfig.FilterMaskIdLow      = 0x0000;
         sFilterConfig.FilterFIFOAssignment = CAN_FILTER_FIFO0;
         sFilterConfig.FilterActivation     = CAN_FILTER_ENABLE;
-        sFilterConfig.SlaveStartFilterBank = hal_slave_start_filter_bank;
+        sFilterConfig.SlaveStartFilterBank = config.hal_slave_start_filter_bank;
 
         constexpr auto ok = HAL_OK;
         assert_always(HAL_CAN_ConfigFilter(hal_can_handle_, &sFilterConfig) == ok);
         assert_always(HAL_CAN_Start(hal_can_handle_) == ok);
         assert_always(
-            HAL_CAN_ActivateNotification(hal_can_handle_, CAN_IT_RX_FIFO0_MSG_PENDING) == ok);
+            HAL_CAN_ActivateNotification(
+                hal_can_handle_, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_TX_MAILBOX_EMPTY)
+            == ok);
+
+        // Unlike the receive lines, the transmit lines are not configured by CubeMX.
+        HAL_NVIC_EnableIRQ(config.transmit_irqn);
     }
 
-    bool read_device_write_buffer(
-        usb::InterruptSafeBuffer& buffer_wrapper, usb::field::UplinkId field_id) {
+    struct ReceivedFrame {
+        uint32_t rir, rdtr;
+        uint32_t data[2];
+    };
+
+    static constexpr size_t receive_fifo_depth = 3;
+
+    // Drain FIFO 0 and uplink every frame not consumed by the bridge, all pending frames share a
+    // single allocation so back-to-back traffic pays the allocation cost once per burst.
+    void read_device_write_buffer(usb::InterruptSafeBuffer& buffer_wrapper) {
         auto hal_can_state    = hal_can_handle_->State;
         auto hal_can_instance = hal_can_handle_->Instance;
 
         assert_always(
             (hal_can_state == HAL_CAN_STATE_READY) || (hal_can_state == HAL_CAN_STATE_LISTENING));
-        assert_always((hal_can_instance->RF0R & CAN_RF0R_FMP0) != 0U); // Assert if rx_fifo is empty
-
-        auto hal_can_instance_rir  = hal_can_instance->sFIFOMailBox[CAN_RX_FIFO0].RIR;
-        auto hal_can_instance_rdtr = hal_can_instance->sFIFOMailBox[CAN_RX_FIFO0].RDTR;
-
-        bool is_extended_can_id     = static_cast<bool>(CAN_RI0R_IDE & hal_can_instance_rir);
-        bool is_remote_transmission = static_cast<bool>(CAN_RI0R_RTR & hal_can_instance_rir);
-        size_t can_data_length      = (CAN_RDT0R_DLC & hal_can_instance_rdtr) >> CAN_RDT0R_DLC_Pos;
-
-        // Calculate field size and try to allocate from buffer
-        std::byte* buffer = buffer_wrapper.allocate(
-            sizeof(FieldHeader)
-            + (is_extended_can_id ? sizeof(CanExtendedId) : sizeof(CanStandardId))
-            + can_data_length);
-
-        if (buffer) {
-            // Write field header
-            auto& header = *new (buffer) FieldHeader{};
-            buffer += sizeof(FieldHeader);
-            header.field_id               = static_cast<uint8_t>(field_id);
-            header.is_extended_can_id     = is_extended_can_id;
-            header.is_remote_transmission = is_remote_transmission;
-            header.has_can_data           = static_cast<bool>(can_data_length);
-
-            // Write CAN id and data length
-            if (is_extended_can_id) {
-                auto& ext_id = *new (buffer) CanExtendedId{};
-                buffer += sizeof(CanExtendedId);
-                ext_id.can_id =
-                    ((CAN_RI0R_EXID | CAN_RI0R_STID) & hal_can_instance_rir) >> CAN_RI0R_EXID_Pos;
-                ext_id.data_length = can_data_length - 1;
-            } else [[likely]] {
-                auto& std_id = *new (buffer) CanStandardId{};
-                buffer += sizeof(CanStandardId);
-                std_id.can_id      = (CAN_RI0R_STID & hal_can_instance_rir) >> CAN_TI0R_STID_Pos;
-                std_id.data_length = can_data_length - 1;
-            }
 
-            // Write CAN data
-            uint32_t can_data[2];
-            can_data[0] = hal_can_instance->sFIFOMailBox[CAN_RX_FIFO0].RDLR;
-            can_data[1] = hal_can_instance->sFIFOMailBox[CAN_RX_FIFO0].RDHR;
-            std::memcpy(buffer, can_data, can_data_length);
-            buffer += can_data_length;
+        while (hal_can_instance->RF0R & CAN_RF0R_FMP0) {
+            ReceivedFrame frames[receive_fifo_depth];
+            size_t count = 0, size = 0;
+
+            do {
+                auto& mailbox = hal_can_instance->sFIFOMailBox[CAN_RX_FIFO0];
+                auto& frame   = frames[count];
+                frame.rir     = mailbox.RIR;
+                frame.rdtr    = mailbox.RDTR;
+                frame.data[0] = mailbox.RDLR;
+                frame.data[1] = mailbox.RDHR;
+
+                // Release the FIFO, FMP0 is valid again once the hardware clears RFOM0.
+                hal_can_instance->RF0R |= CAN_RF0R_RFOM0;
+                while (hal_can_instance->RF0R & CAN_RF0R_RFOM0)
+                    ;
+
+                logger::trace::write(
+                    logger::trace::Event::CAN_RECEIVED, static_cast<uint16_t>(uplink_field_id_),
+                    frame.rir, frame.rdtr);
+                if (bridge(frame.rir, frame.rdtr, frame.data)) {
+                    size += field_size(frame);
+                    count++;
+                }
+            } while (count < receive_fifo_depth && (hal_can_instance->RF0R & CAN_RF0R_FMP0));
+
+            if (!count)
+                continue;
+
+            // Frames are dropped if the buffer is full, as the FIFO has been released already.
+            std::byte* buffer = buffer_wrapper.allocate(size);
+            if (!buffer) [[unlikely]]
+                continue;
+            for (size_t i = 0; i < count; i++)
+                write_field(buffer, frames[i]);
         }
+    }
+
+    static size_t field_size(const ReceivedFrame& frame) {
+        return sizeof(FieldHeader)
+             + ((CAN_RI0R_IDE & frame.rir) ? sizeof(CanExtendedId) : sizeof(CanStandardId))
+             + ((CAN_RDT0R_DLC & frame.rdtr) >> CAN_RDT0R_DLC_Pos);
+    }
 
-        // Release the FIFO
-        hal_can_instance->RF0R |= CAN_RF0R_RFOM0;
+    void write_field(std::byte*& buffer, const ReceivedFrame& frame) const {
+        bool is_extended_can_id     = static_cast<bool>(CAN_RI0R_IDE & frame.rir);
+        bool is_remote_transmission = static_cast<bool>(CAN_RI0R_RTR & frame.rir);
+        size_t can_data_length      = (CAN_RDT0R_DLC & frame.rdtr) >> CAN_RDT0R_DLC_Pos;
+
+        // Write field header
+        auto& header = *new (buffer) FieldHeader{};
+        buffer += sizeof(FieldHeader);
+        header.field_id               = static_cast<uint8_t>(uplink_field_id_);
+        header.is_extended_can_id     = is_extended_can_id;
+        header.is_remote_transmission = is_remote_transmission;
+        header.has_can_data           = static_cast<bool>(can_data_length);
+
+        // Write CAN id and data length
+        if (is_extended_can_id) {
+            auto& ext_id = *new (buffer) CanExtendedId{};
+            buffer += sizeof(CanExtendedId);
+            ext_id.can_id = ((CAN_RI0R_EXID | CAN_RI0R_STID) & frame.rir) >> CAN_RI0R_EXID_Pos;
+            ext_id.data_length = can_data_length - 1;
+        } else [[likely]] {
+            auto& std_id = *new (buffer) CanStandardId{};
+            buffer += sizeof(CanStandardId);
+            std_id.can_id      = (CAN_RI0R_STID & frame.rir) >> CAN_TI0R_STID_Pos;
+            std_id.data_length = can_data_length - 1;
+        }
 
-        return static_cast<bool>(buffer);
+        // Write CAN data
+        std::memcpy(buffer, frame.data, can_data_length);
+        buffer += can_data_length;
     }
 
     CAN_HandleTypeDef* hal_can_handle_;
+    usb::field::UplinkId uplink_field_id_;
+    const uint32_t default_bit_timing_;
+    std::atomic<uint32_t> pending_bit_timing_     = 0;
+    std::atomic<uint16_t> bus_off_recovery_delay_ = 0;
+    uint32_t bus_off_tick_                        = 0;
+    bool bus_off_recovering_                      = false;
+
+    StatusField::Status status_{}, reported_status_{};
+    uint32_t report_tick_ = 0;
 
     struct __attribute__((packed)) FieldHeader {
         uint8_t field_id            : 4;
         bool is_extended_can_id     : 1;
         bool is_remote_transmission : 1;
         bool has_can_data           : 1;
+        bool is_reliable            : 1; // Downlink only, retry on failure before reporting it
     };
 
     struct __attribute__((packed)) CanStandardId {
@@ -195,11 +638,148 @@ private:
         uint32_t identifier;                // CAN_TxMailBox_TypeDef::TIR
         uint32_t data_length_and_timestamp; // CAN_TxMailBox_TypeDef::TDTR
         uint32_t data[2];                   // CAN_TxMailBox_TypeDef::TDLR & TDHR
+        uint8_t retry_budget;               // Remaining attempts of reliable frames, 0 otherwise
     };
     utility::RingBuffer<TransmitMailboxData, 16> transmit_buffer_;
-};
 
-inline constinit Can::Lazy can1{&hcan1, 0, 14};
-inline constinit Can::Lazy can2{&hcan2, 14, 14};
+    // Read a downlink CAN field from buffer and construct the mailbox data into storage.
+    static void construct_mailbox_data(std::byte*& buffer, std::byte* storage) {
+        auto& mailbox = *new (storage) TransmitMailboxData{};
+
+        auto& header = *std::launder(reinterpret_cast<const FieldHeader*>(buffer));
+        buffer += sizeof(header);
+
+        uint8_t can_data_length;
+        if (header.is_extended_can_id) {
+            auto& ext_id = *std::launder(reinterpret_cast<const CanExtendedId*>(buffer));
+            buffer += sizeof(ext_id);
+            mailbox.identifier = (ext_id.can_id << CAN_TI0R_EXID_Pos) | CAN_ID_EXT;
+            can_data_length    = header.has_can_data ? ext_id.data_length + 1 : 0;
+        } else [[likely]] {
+            auto& std_id = *std::launder(reinterpret_cast<const CanStandardId*>(buffer));
+            buffer += sizeof(std_id);
+            mailbox.identifier = (std_id.can_id << CAN_TI0R_STID_Pos) | CAN_ID_STD;
+            can_data_length    = header.has_can_data ? std_id.data_length + 1 : 0;
+        }
+        mailbox.identifier |= header.is_remote_transmission ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+        mailbox.identifier |= CAN_TI0R_TXRQ;
+        mailbox.data_length_and_timestamp = can_data_length;
+        mailbox.retry_budget = header.is_reliable ? reliable_retry_budget : 0;
+
+        // Always read full 8 bytes to reduce the number of if-branches for performance
+        // considerations (almost all CAN messages have a length of 8 bytes). Downlink packets are
+        // padded, so this never reads past their buffer.
+        std::memcpy(mailbox.data, buffer, 8);
+        buffer += can_data_length;
+    }
+
+    struct PeriodicSlot {
+        TransmitMailboxData frame;
+        uint32_t period; // Microseconds, 0 if the slot is unused
+        uint32_t next_due;
+    };
+    PeriodicSlot periodic_slots_[periodic_slot_count]{};
+    utility::RingBuffer<TransmitMailboxData, 8> periodic_buffer_;
+
+    BridgeRule bridge_rules_[bridge_rule_count]{};
+    // Produced by the RX interrupts of source buses, which share the same priority and therefore
+    // never preempt each other.
+    utility::RingBuffer<TransmitMailboxData, 8> bridge_buffer_;
+
+    // Forward a received frame to other buses according to the bridge rules, return whether the
+    // frame should be forwarded to the host as well.
+    bool bridge(uint32_t rir, uint32_t rdtr, const uint32_t (&data)[2]) {
+        bool is_extended_can_id = rir & CAN_RI0R_IDE;
+        uint32_t can_id;
+        if (is_extended_can_id)
+            can_id = ((CAN_RI0R_EXID | CAN_RI0R_STID) & rir) >> CAN_RI0R_EXID_Pos;
+        else [[likely]]
+            can_id = (CAN_RI0R_STID & rir) >> CAN_RI0R_STID_Pos;
+
+        bool forward_to_host = true;
+        for (auto& rule : bridge_rules_) {
+            if (!rule.target || rule.is_extended_can_id != is_extended_can_id
+                || ((can_id ^ rule.match_id) & rule.match_mask)) [[likely]]
+                continue;
+
+            TransmitMailboxData frame;
+            uint32_t id = (can_id & ~rule.rewrite_mask) | (rule.rewrite_id & rule.rewrite_mask);
+            if (is_extended_can_id)
+                frame.identifier =
+                    ((id << CAN_TI0R_EXID_Pos) & (CAN_TI0R_EXID | CAN_TI0R_STID)) | CAN_ID_EXT;
+            else [[likely]]
+                frame.identifier = ((id << CAN_TI0R_STID_Pos) & CAN_TI0R_STID) | CAN_ID_STD;
+            frame.identifier |= (CAN_RI0R_RTR & rir) | CAN_TI0R_TXRQ;
+            frame.data_length_and_timestamp = CAN_RDT0R_DLC & rdtr;
+            frame.data[0]                   = data[0];
+            frame.data[1]                   = data[1];
+            frame.retry_budget              = 0;
+
+            // Straight into a mailbox of the target bus, unless earlier frames still wait.
+            auto& target = *rule.target;
+            if (target.bridge_buffer_.readable() || !target.transmit_immediately(frame)) {
+                if (target.bridge_buffer_.emplace_back(frame)) [[likely]]
+                    event::signal(event::DOWNLINK);
+                else
+                    led::led->downlink_buffer_full();
+            }
+
+            forward_to_host &= rule.forward_to_host;
+        }
+
+        return forward_to_host;
+    }
+
+    // Load the frame into a free mailbox right away, from the scheduler or bridge interrupts.
+    // Return false if no mailbox is free or the controller is being reconfigured, the caller
+    // queues the frame for the main loop then.
+    bool transmit_immediately(const TransmitMailboxData& mailbox_data) {
+        auto hal_can_instance = hal_can_handle_->Instance;
+
+        utility::InterruptLockGuard guard;
+        if (hal_can_instance->MCR & CAN_MCR_INRQ) [[unlikely]]
+            return false;
+        uint32_t mailboxes = loadable_mailboxes(collect_transmit_status());
+        if (!mailboxes)
+            return false;
+        load_mailbox(mailboxes, mailbox_data);
+        return true;
+    }
+
+    // Mask of the mailboxes empty in tsr that may be loaded. A mailbox whose reliable frame
+    // completed after tsr was read is skipped until its RQCP has been processed, as loading it
+    // would clear the result of the reliable frame.
+    uint32_t loadable_mailboxes(uint32_t tsr) const {
+        uint32_t mailboxes = 0;
+        for (size_t i = 0; i < 3; i++)
+            if ((tsr & (CAN_TSR_TME0 << i)) && !reliable_mailboxes_[i].retry_budget)
+                mailboxes |= 1u << i;
+        return mailboxes;
+    }
+
+    // Load the frame into the lowest mailbox of the mask returned by loadable_mailboxes, and
+    // remove that mailbox from the mask.
+    void load_mailbox(uint32_t& mailboxes, const TransmitMailboxData& mailbox_data) {
+        auto index = static_cast<size_t>(std::countr_zero(mailboxes));
+        assert_always(index < 3);
+        mailboxes &= mailboxes - 1;
+
+        write_mailbox(index, mailbox_data);
+        if (mailbox_data.retry_budget) [[unlikely]]
+            reliable_mailboxes_[index] = mailbox_data;
+    }
+
+    void write_mailbox(size_t index, const TransmitMailboxData& mailbox_data) {
+        auto& target_mailbox = hal_can_handle_->Instance->sTxMailBox[index];
+        target_mailbox.TDTR  = mailbox_data.data_length_and_timestamp;
+        target_mailbox.TDLR  = mailbox_data.data[0];
+        target_mailbox.TDHR  = mailbox_data.data[1];
+        target_mailbox.TIR   = mailbox_data.identifier;
+    }
+
+    // Number of attempts of a reliable frame before its failure is reported.
+    static constexpr uint8_t reliable_retry_budget = 8;
+    TransmitMailboxData reliable_mailboxes_[3]{};
+};
 
 } // namespace can
@@ -0,0 +1,40 @@
+#include "app/can/scheduler.hpp"
+
+#include <algorithm>
+
+#include "app/can/can.hpp"
+#include "app/event.hpp"
+#include "app/interfaces.hpp"
+#include "app/timer/profiler.hpp"
+
+namespace can {
+
+void Scheduler::timer_callback() {
+    timer::profiler::Scope profile{timer::profiler::Point::CAN_SCHEDULER};
+    TIM2->SR = ~TIM_SR_CC1IF;
+    event::signal(event::DOWNLINK);
+
+    while (true) {
+        uint32_t now   = Scheduler::now();
+        uint32_t delay = Can::no_periodic_frame;
+        for (auto& entry : interfaces::cans)
+            delay = std::min(delay, (*entry.lazy)->transmit_periodic(now));
+        if (delay == Can::no_periodic_frame) {
+            TIM2->DIER &= ~TIM_DIER_CC1IE;
+            return;
+        }
+
+        TIM2->CCR1 = now + delay;
+        // The compare event is lost if the due time has already passed, check it manually.
+        if (static_cast<int32_t>(now + delay - Scheduler::now()) > 0)
+            return;
+    }
+}
+
+} // namespace can
+
+extern "C" {
+
+void TIM2_IRQHandler() { can::Scheduler::timer_callback(); }
+
+} // extern "C"
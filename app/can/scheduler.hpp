@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+#include <main.h>
+
+#include "utility/immovable.hpp"
+#include "utility/lazy.hpp"
+
+extern "C" {
+void TIM2_IRQHandler();
+}
+
+namespace can {
+
+// Drives the periodic CAN frames of all buses with a free-running 1MHz TIM2 counter, whose
+// compare channel 1 is always programmed to the earliest due frame.
+class Scheduler : private utility::Immovable {
+public:
+    using Lazy = utility::Lazy<Scheduler>;
+
+    Scheduler() {
+        __HAL_RCC_TIM2_CLK_ENABLE();
+
+        // TIM2 is clocked at 2 * PCLK1 = 84MHz.
+        TIM2->PSC  = 84 - 1;
+        TIM2->ARR  = 0xFFFFFFFF;
+        TIM2->EGR  = TIM_EGR_UG;
+        TIM2->SR   = 0;
+        TIM2->CR1 |= TIM_CR1_CEN;
+
+        HAL_NVIC_EnableIRQ(TIM2_IRQn);
+    }
+
+    // Current time in microseconds, wrapping.
+    static uint32_t now() { return TIM2->CNT; }
+
+    // Re-evaluate the table in the timer interrupt, must be called after any entry is changed.
+    static void reschedule() {
+        TIM2->DIER |= TIM_DIER_CC1IE;
+        TIM2->EGR = TIM_EGR_CC1G;
+    }
+
+private:
+    friend void ::TIM2_IRQHandler();
+
+    static void timer_callback();
+};
+
+inline constinit Scheduler::Lazy scheduler;
+
+} // namespace can
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+#include <atomic>
+
+#include <main.h>
+
+#include "app/logger/trace.hpp"
+#include "app/timer/profiler.hpp"
+#include "utility/interrupt_lock.hpp"
+
+// Work signalled to the main loop by its producers. The main loop only polls the consumers of
+// pending sources, and sleeps with WFI while there are none.
+namespace event {
+
+enum Source : uint32_t {
+    USB_RECEIVE = 1 << 0, // OUT packet received
+    UPLINK      = 1 << 1, // Uplink data queued, or the IN endpoint became free
+    DOWNLINK    = 1 << 2, // CAN or UART transmission queued, or queue space freed
+    TICK        = 1 << 3, // Every millisecond, for rate limited reports and timeouts
+};
+
+inline constinit std::atomic<uint32_t> pending = 0;
+
+// Safe from any context.
+inline void signal(uint32_t sources) {
+    if (!pending.fetch_or(sources, std::memory_order::relaxed))
+        timer::profiler::first_signal();
+}
+
+// Called by the main loop: take the pending sources, sleeping until there is at least one.
+// Interrupts are disabled between the check and WFI, so a signal can not be missed in between,
+// and WFI still wakes up on the masked interrupt, which runs right after re-enabling.
+inline uint32_t wait() {
+    while (true) {
+        uint32_t sources;
+        {
+            utility::InterruptLockGuard guard;
+            sources = pending.exchange(0, std::memory_order::relaxed);
+            if (!sources) {
+                __DSB();
+                __WFI();
+            }
+        }
+        if (sources) {
+            timer::profiler::woken_up();
+            logger::trace::write(logger::trace::Event::WAKE_UP, 0, sources);
+            return sources;
+        }
+    }
+}
+
+} // namespace event
@@ -1,19 +1,26 @@
 #include <cstdint>
 
 #include <main.h>
-#include <stm32f4xx_hal_gpio.h>
 
 #include "app/spi/bmi088/accel.hpp"
 #include "app/spi/bmi088/gyro.hpp"
+#include "app/timer/profiler.hpp"
 
 extern "C" {
 
-void HAL_GPIO_EXTI_Callback(uint16_t gpio_pin) {
-    if (gpio_pin == INT1_ACC_Pin) {
-        spi::bmi088::accelerometer->data_ready_callback();
-    } else if (gpio_pin == INT1_GYRO_Pin) {
-        spi::bmi088::gyroscope->data_ready_callback();
-    }
+// Called from the USER CODE sections of EXTIx_IRQHandler in place of HAL_GPIO_EXTI_IRQHandler.
+// Each line carries a single interrupt pin, so the pending bit is cleared without being checked.
+
+void exti4_irq_handler() {
+    timer::profiler::Scope profile{timer::profiler::Point::IMU_READ};
+    EXTI->PR = INT1_ACC_Pin;
+    spi::bmi088::accelerometer->data_ready_callback();
+}
+
+void exti9_5_irq_handler() {
+    timer::profiler::Scope profile{timer::profiler::Point::IMU_READ};
+    EXTI->PR = INT1_GYRO_Pin;
+    spi::bmi088::gyroscope->data_ready_callback();
 }
 
-}; // extern "C"
\ No newline at end of file
+}; // extern "C"
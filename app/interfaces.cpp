@@ -0,0 +1,22 @@
+#include "app/interfaces.hpp"
+
+extern "C" {
+
+// Called from the USER CODE sections of the CubeMX handlers, in place of the HAL handlers.
+void can1_rx0_irq_handler() { interfaces::handle_interrupt<CAN1_RX0_IRQn>(); }
+void can2_rx0_irq_handler() { interfaces::handle_interrupt<CAN2_RX0_IRQn>(); }
+void usart1_irq_handler() { interfaces::handle_interrupt<USART1_IRQn>(); }
+void usart3_irq_handler() { interfaces::handle_interrupt<USART3_IRQn>(); }
+void usart6_irq_handler() { interfaces::handle_interrupt<USART6_IRQn>(); }
+
+// Lines not configured by CubeMX.
+void CAN1_TX_IRQHandler() { interfaces::handle_interrupt<CAN1_TX_IRQn>(); }
+void CAN2_TX_IRQHandler() { interfaces::handle_interrupt<CAN2_TX_IRQn>(); }
+void DMA1_Stream1_IRQHandler() { interfaces::handle_interrupt<DMA1_Stream1_IRQn>(); }
+void DMA1_Stream3_IRQHandler() { interfaces::handle_interrupt<DMA1_Stream3_IRQn>(); }
+void DMA2_Stream1_IRQHandler() { interfaces::handle_interrupt<DMA2_Stream1_IRQn>(); }
+void DMA2_Stream5_IRQHandler() { interfaces::handle_interrupt<DMA2_Stream5_IRQn>(); }
+void DMA2_Stream6_IRQHandler() { interfaces::handle_interrupt<DMA2_Stream6_IRQn>(); }
+void DMA2_Stream7_IRQHandler() { interfaces::handle_interrupt<DMA2_Stream7_IRQn>(); }
+
+} // extern "C"
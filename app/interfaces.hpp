@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+
+#include <array>
+#include <utility>
+
+#include <main.h>
+
+#include "app/can/can.hpp"
+#include "app/interrupt_priority.hpp"
+#include "app/timer/profiler.hpp"
+#include "app/uart/uart.hpp"
+#include "app/usb/cdc.hpp"
+#include "app/usb/field.hpp"
+#include "utility/interrupt_lock.hpp"
+
+// Every forwarded interface with its downlink field id and peripheral resources. The interface
+// objects, their interrupt priorities, initialization, main loop polling, downlink routing and
+// interrupt dispatch are all generated from these lists, so a new port only needs an entry here
+// and the thunks of its vector table entries in app/interfaces.cpp. The lists are constant, so
+// loops over them unroll into direct calls.
+namespace interfaces {
+
+template <typename Config>
+struct Port {
+    usb::field::DownlinkId downlink_id;
+    Config config;
+};
+
+inline constexpr std::array can_ports{
+    Port<can::Can::Config>{
+        usb::field::DownlinkId::CAN1_,
+        {&hcan1, usb::field::UplinkId::CAN1_, 0, 14, CAN1_RX0_IRQn, CAN1_TX_IRQn}},
+    Port<can::Can::Config>{
+        usb::field::DownlinkId::CAN2_,
+        {&hcan2, usb::field::UplinkId::CAN2_, 14, 14, CAN2_RX0_IRQn, CAN2_TX_IRQn}},
+};
+
+inline constexpr std::array uart_ports{
+    Port<uart::Uart::Config>{
+        usb::field::DownlinkId::UART1_,
+        {&huart6, USART6_IRQn, usb::field::UplinkId::UART1_, 15,
+         {DMA2_Stream1_BASE, 5, DMA2_Stream1_IRQn}, {DMA2_Stream6_BASE, 5, DMA2_Stream6_IRQn}}},
+    Port<uart::Uart::Config>{
+        usb::field::DownlinkId::UART2_,
+        {&huart1, USART1_IRQn, usb::field::UplinkId::UART2_, 15,
+         {DMA2_Stream5_BASE, 4, DMA2_Stream5_IRQn}, {DMA2_Stream7_BASE, 4, DMA2_Stream7_IRQn}}},
+    // DBUS receiver
+    Port<uart::Uart::Config>{
+        usb::field::DownlinkId::UART3_,
+        {&huart3, USART3_IRQn, usb::field::UplinkId::UART3_, 31,
+         {DMA1_Stream1_BASE, 4, DMA1_Stream1_IRQn}, {DMA1_Stream3_BASE, 4, DMA1_Stream3_IRQn}}},
+};
+
+template <size_t index>
+inline constinit can::Can::Lazy can_object{can_ports[index].config};
+
+template <size_t index>
+inline constinit uart::Uart::Lazy uart_object{uart_ports[index].config};
+
+template <typename Lazy>
+struct Entry {
+    usb::field::DownlinkId downlink_id;
+    Lazy* lazy;
+};
+
+inline constexpr auto cans = []<size_t... i>(std::index_sequence<i...>) {
+    return std::array{Entry<can::Can::Lazy>{can_ports[i].downlink_id, &can_object<i>}...};
+}(std::make_index_sequence<can_ports.size()>{});
+
+inline constexpr auto uarts = []<size_t... i>(std::index_sequence<i...>) {
+    return std::array{Entry<uart::Uart::Lazy>{uart_ports[i].downlink_id, &uart_object<i>}...};
+}(std::make_index_sequence<uart_ports.size()>{});
+
+// Called by the application with interrupts enabled, as HAL_GetTick timeouts are used while the
+// objects are constructed. The priorities are set before the objects enable their interrupts, and
+// under the lock as CubeMX has already enabled some of the lines.
+inline void init() {
+    {
+        utility::InterruptLockGuard guard;
+        for (auto& port : can_ports) {
+            HAL_NVIC_SetPriority(port.config.receive_irqn, interrupt_priority::can_receive, 0);
+            HAL_NVIC_SetPriority(port.config.transmit_irqn, interrupt_priority::can_transmit, 0);
+        }
+        for (auto& port : uart_ports) {
+            HAL_NVIC_SetPriority(port.config.irqn, interrupt_priority::uart, 0);
+            HAL_NVIC_SetPriority(port.config.receive_dma.irqn(), interrupt_priority::uart, 0);
+            HAL_NVIC_SetPriority(port.config.transmit_dma.irqn(), interrupt_priority::uart, 0);
+        }
+    }
+
+    for (auto& entry : cans)
+        entry.lazy->init();
+    for (auto& entry : uarts)
+        entry.lazy->init();
+}
+
+// Call function with every interface object, CAN buses first.
+template <typename F>
+inline void for_each(F&& function) {
+    for (auto& entry : cans)
+        function(**entry.lazy);
+    for (auto& entry : uarts)
+        function(**entry.lazy);
+}
+
+inline can::Can* find_can(usb::field::DownlinkId downlink_id) {
+    for (auto& entry : cans)
+        if (entry.downlink_id == downlink_id)
+            return entry.lazy->get();
+    return nullptr;
+}
+
+inline uart::Uart* find_uart(usb::field::DownlinkId downlink_id) {
+    for (auto& entry : uarts)
+        if (entry.downlink_id == downlink_id)
+            return entry.lazy->get();
+    return nullptr;
+}
+
+// Index of the first port whose config matches, or the size of the list.
+template <typename Ports, typename F>
+consteval size_t find_port(const Ports& ports, F&& matches) {
+    size_t index = 0;
+    while (index < ports.size() && !matches(ports[index].config))
+        index++;
+    return index;
+}
+
+// Handle the interrupt irqn of the interface that owns it, resolved at compile time.
+template <IRQn_Type irqn>
+inline void handle_interrupt() {
+    constexpr size_t can_index = find_port(can_ports, [](const can::Can::Config& config) {
+        return config.receive_irqn == irqn || config.transmit_irqn == irqn;
+    });
+    constexpr size_t uart_index = find_port(uart_ports, [](const uart::Uart::Config& config) {
+        return config.irqn == irqn || config.receive_dma.irqn() == irqn
+            || config.transmit_dma.irqn() == irqn;
+    });
+    static_assert(
+        can_index < can_ports.size() || uart_index < uart_ports.size(),
+        "The interrupt is not used by any interface");
+
+    if constexpr (can_index < can_ports.size()) {
+        auto& can = can_object<can_index>;
+        if constexpr (irqn == can_ports[can_index].config.receive_irqn)
+            can->receive_irq_handler(usb::cdc->get_transmit_buffer());
+        else
+            can->transmit_irq_handler();
+    } else {
+        constexpr auto& config = uart_ports[uart_index].config;
+        auto& uart             = uart_object<uart_index>;
+        if constexpr (irqn == config.irqn)
+            uart->irq_handler(usb::cdc->get_transmit_buffer());
+        else if constexpr (irqn == config.receive_dma.irqn())
+            uart->dma_receive_irq_handler(usb::cdc->get_transmit_buffer());
+        else
+            uart->dma_transmit_irq_handler();
+    }
+}
+
+} // namespace interfaces
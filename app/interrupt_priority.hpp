@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+
+#include <main.h>
+
+// NVIC preemption priorities of all interrupt sources (priority group 4, no sub-priority, a lower
+// value preempts a higher one). CubeMX assigns its own values in the MSP init functions, apply()
+// overrides them before any module is initialized.
+//
+// Nested preemption of the shared structures:
+// - usb::InterruptSafeBuffer is allocated with CAS from any context and only consumed by the main
+//   loop, which every producer completes before, so any nesting is safe.
+// - Can::periodic_buffer_ has the scheduler as its only producer and the main loop as consumer.
+//   Downlink packets are parsed by the main loop, so Can::transmit_buffer_ and the UART transmit
+//   buffers are only filled from there.
+// - Can::bridge_buffer_ is written by the receive interrupts of both buses, which must not
+//   preempt each other.
+// - Both IMU lines perform blocking transfers on the shared SPI bus, and must not preempt each
+//   other either.
+// - The CAN transmit mailboxes are loaded by the main loop, by the scheduler and by the bridge in
+//   the receive interrupts, always under utility::InterruptLockGuard.
+// - Configuration shared with interrupts is written under utility::InterruptLockGuard.
+namespace interrupt_priority {
+
+// IMU data ready lines and their SPI bus: a late sample is a lost sample.
+constexpr uint32_t imu = 1;
+
+// CAN receive FIFOs overflow after 3 frames, about 150us at 1Mbps.
+constexpr uint32_t can_receive = 2;
+
+// Periodic CAN frames, loads due frames straight into free mailboxes.
+constexpr uint32_t can_scheduler = 3;
+
+// Completed CAN transmit mailboxes, retries reliable frames and wakes up the main loop.
+constexpr uint32_t can_transmit = 3;
+
+// UART idle line and DMA events, which uplink what the circular receive buffers collected.
+constexpr uint32_t uart = 4;
+
+// USB only hands OUT packets over to the main loop, and runs below every forwarding path.
+constexpr uint32_t usb = 5;
+
+static_assert(imu < can_receive && can_receive < uart && uart < usb);
+static_assert(can_receive < can_transmit, "Mailbox completion waits for received frames");
+static_assert(usb < TICK_INT_PRIORITY, "HAL_GetTick timeouts are only used from the main loop");
+
+inline void apply() {
+    HAL_NVIC_SetPriority(EXTI4_IRQn, imu, 0);
+    HAL_NVIC_SetPriority(EXTI9_5_IRQn, imu, 0);
+    HAL_NVIC_SetPriority(SPI1_IRQn, imu, 0);
+
+    HAL_NVIC_SetPriority(TIM2_IRQn, can_scheduler, 0);
+
+    // The lines of the CAN buses and UARTs are set by interfaces::init from their entries.
+
+    HAL_NVIC_SetPriority(OTG_FS_IRQn, usb, 0);
+}
+
+} // namespace interrupt_priority
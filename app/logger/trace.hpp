@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <atomic>
+#include <bit>
+
+#include <main.h>
+
+#ifdef APP_TRACE
+#include <bsp/SEGGER/RTT/SEGGER_RTT.h>
+#endif
+
+// Binary event trace on SEGGER RTT up channel 1, decoded on the host by script/decode_trace.py.
+// Only built with `xmake f --trace=y`, otherwise every call below compiles to nothing.
+//
+// Unlike Logger::printf, writing a record neither formats nor locks, so events can be traced from
+// any interrupt. When the host does not keep up, records are dropped and counted in the next one.
+namespace logger::trace {
+
+// Keep in sync with script/decode_trace.py.
+enum class Event : uint8_t {
+    SCOPE_BEGIN   = 0, // arg0: timer::profiler::Point
+    SCOPE_END     = 1, // arg0: timer::profiler::Point
+    WAKE_UP       = 2, // arg1: event::Source bits taken by the main loop
+    CAN_RECEIVED  = 3, // arg0: UplinkId of the bus, arg1: CAN_RIxR, arg2: CAN_RDTxR
+    UART_RECEIVED = 4, // arg0: UplinkId, arg1: data size, arg2: 0 if the uplink buffer was full
+    USB_RECEIVED  = 5, // arg1: OUT packet size
+    USB_TRANSMIT  = 6, // arg1: IN batch size
+};
+
+struct __attribute__((packed)) Record {
+    uint32_t timestamp; // DWT->CYCCNT
+    Event event;
+    uint8_t dropped;    // Records lost right before this one, saturated at 255
+    uint16_t arg0;
+    uint32_t arg1, arg2;
+};
+static_assert(sizeof(Record) == 16);
+
+#ifdef APP_TRACE
+
+constexpr unsigned channel     = 1;
+constexpr size_t buffer_size   = 2048;
+constexpr uint32_t offset_mask = buffer_size - 1;
+static_assert(std::has_single_bit(buffer_size) && buffer_size % sizeof(Record) == 0);
+
+alignas(4) inline constinit std::byte buffer[buffer_size];
+
+// Free running byte count of reserved records, WrOff follows it once they are written.
+inline constinit std::atomic<uint32_t> reserved = 0;
+// Number of writers currently nested on top of each other.
+inline constinit std::atomic<uint32_t> depth  = 0;
+inline constinit std::atomic<uint8_t> dropped = 0;
+
+inline volatile SEGGER_RTT_BUFFER_UP& up_buffer() { return _SEGGER_RTT.aUp[channel]; }
+
+inline void init() {
+    SEGGER_RTT_ConfigUpBuffer(channel, "Trace", buffer, buffer_size, SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+}
+
+// Writers preempting each other on a single core nest strictly, so only the outermost one moves
+// WrOff, to the end of every record reserved so far. It never moves backwards or over a record
+// still being written by a preempted writer.
+inline void publish() {
+    while (depth.load(std::memory_order::relaxed) == 1) {
+        auto end = reserved.load(std::memory_order::relaxed);
+        std::atomic_signal_fence(std::memory_order::release);
+        up_buffer().WrOff = end & offset_mask;
+
+        depth.store(0, std::memory_order::relaxed);
+        // A writer nested after loading end has left its record to us.
+        if (reserved.load(std::memory_order::relaxed) == end)
+            return;
+        depth.store(1, std::memory_order::relaxed);
+    }
+    depth.fetch_sub(1, std::memory_order::relaxed);
+}
+
+inline void write_at(
+    uint32_t timestamp, Event event, uint16_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0) {
+    depth.fetch_add(1, std::memory_order::relaxed);
+
+    // One record is always left free, as RTT treats WrOff == RdOff as empty.
+    auto offset = reserved.load(std::memory_order::relaxed);
+    bool space;
+    do {
+        space = ((offset - up_buffer().RdOff) & offset_mask) + sizeof(Record) < buffer_size;
+    } while (space
+             && !reserved.compare_exchange_weak(
+                 offset, offset + sizeof(Record), std::memory_order::relaxed));
+
+    if (space) [[likely]] {
+        Record record{
+            timestamp, event, dropped.exchange(0, std::memory_order::relaxed), arg0, arg1, arg2};
+        std::memcpy(&buffer[offset & offset_mask], &record, sizeof(Record));
+    } else {
+        auto count = dropped.load(std::memory_order::relaxed);
+        while (count != UINT8_MAX
+               && !dropped.compare_exchange_weak(
+                   count, static_cast<uint8_t>(count + 1), std::memory_order::relaxed))
+            ;
+    }
+
+    publish();
+}
+
+inline void write(Event event, uint16_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0) {
+    write_at(DWT->CYCCNT, event, arg0, arg1, arg2);
+}
+
+#else
+
+inline void init() {}
+inline void write_at(uint32_t, Event, uint16_t = 0, uint32_t = 0, uint32_t = 0) {}
+inline void write(Event, uint16_t = 0, uint32_t = 0, uint32_t = 0) {}
+
+#endif
+
+} // namespace logger::trace
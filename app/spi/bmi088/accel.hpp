@@ -12,6 +12,10 @@
 #include "app/usb/cdc.hpp"
 #include "utility/assert.hpp"
 
+extern "C" {
+void exti4_irq_handler();
+}
+
 namespace spi::bmi088 {
 
 class Accelerometer final : SpiModuleInterface {
@@ -105,7 +109,7 @@ public:
     }
 
 private:
-    friend void ::HAL_GPIO_EXTI_Callback(uint16_t);
+    friend void ::exti4_irq_handler();
 
     void data_ready_callback() {
         read<SpiTransmitReceiveMode::BLOCK>(RegisterAddress::ACC_X_LSB, 6);
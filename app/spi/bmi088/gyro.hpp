@@ -12,6 +12,11 @@
 #include "app/usb/cdc.hpp"
 #include "app/usb/interrupt_safe_buffer.hpp"
 #include "utility/assert.hpp"
+
+extern "C" {
+void exti9_5_irq_handler();
+}
+
 namespace spi::bmi088 {
 
 class Gyroscope final : SpiModuleInterface {
@@ -108,7 +113,7 @@ public:
     }
 
 private:
-    friend void ::HAL_GPIO_EXTI_Callback(uint16_t);
+    friend void ::exti9_5_irq_handler();
 
     void data_ready_callback() {
         read<SpiTransmitReceiveMode::BLOCK>(RegisterAddress::RATE_X_LSB, 6);
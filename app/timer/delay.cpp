@@ -1,4 +1,5 @@
 #include "app/timer/delay.hpp"
+#include "app/timer/timestamp.hpp"
 #include "app/led/led.hpp"
 
 #include <stm32f4xx_hal.h>
@@ -14,6 +15,7 @@ void HAL_Delay(uint32_t delay) { timer::delay(std::chrono::milliseconds(delay));
 void HAL_IncTick() {
     uint32_t tick = uwTick + 1;
     uwTick        = tick;
+    timer::timestamp::now();
     led::led->update(tick);
 }
 
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <iterator>
+
+#include <main.h>
+
+#include "app/logger/trace.hpp"
+
+#ifdef APP_PROFILER
+#include "app/logger/logger.hpp"
+#include "utility/interrupt_lock.hpp"
+#endif
+
+// Cycle statistics of the hot paths, measured with the DWT cycle counter enabled in main.c. Only
+// built with `xmake f --profiler=y`, otherwise every call below compiles to nothing. The collected
+// statistics are printed on SEGGER RTT channel 0 once per report period and then restarted.
+//
+// Interrupt durations include the time spent in nested interrupts of higher priority. With
+// `xmake f --trace=y`, the scopes are also traced as SCOPE_BEGIN and SCOPE_END events.
+namespace timer::profiler {
+
+inline uint32_t now() { return DWT->CYCCNT; }
+
+enum class Point : uint8_t {
+    CAN_RECEIVE,    // CANx_RX0 interrupt, draining the whole FIFO
+    CAN_SCHEDULER,  // TIM2 interrupt, queueing due periodic frames
+    UART_INTERRUPT, // USART idle line and DMA interrupts
+    IMU_READ,       // EXTI data ready interrupt, including the blocking SPI transfer
+    USB_RECEIVE,    // Cdc::try_receive
+    DOWNLINK_PARSE, // Parsing and forwarding the fields of one downlink packet
+    USB_TRANSMIT,   // Cdc::try_transmit
+    CAN_TRANSMIT,   // Can::try_transmit
+    UART_TRANSMIT,  // Uart::try_transmit
+    MAIN_LOOP,      // One pass of the main loop, without the sleep
+    EVENT_LATENCY,  // From the first signalled event until the main loop has woken up for it
+    COUNT,
+};
+
+#ifdef APP_PROFILER
+
+// Bucket k counts durations below 2^(k + 6) cycles, the last bucket also counts all longer ones.
+constexpr size_t histogram_size = 16, histogram_shift = 6;
+
+constexpr uint32_t report_period_ms = 1000;
+
+struct Stats {
+    uint32_t count = 0, min = UINT32_MAX, max = 0;
+    uint64_t total = 0;
+    uint32_t histogram[histogram_size]{};
+};
+
+// Each point is only recorded from a single priority level, so updates need no lock.
+inline constinit Stats stats[static_cast<size_t>(Point::COUNT)];
+
+inline constinit std::atomic<uint32_t> first_signal_cycle = 0;
+
+inline void record(Point point, uint32_t cycles) {
+    auto& entry = stats[static_cast<size_t>(point)];
+    entry.count++;
+    entry.min = std::min(entry.min, cycles);
+    entry.max = std::max(entry.max, cycles);
+    entry.total += cycles;
+
+    auto bucket = static_cast<size_t>(std::bit_width(cycles >> histogram_shift));
+    entry.histogram[std::min(bucket, histogram_size - 1)]++;
+}
+
+// Called by event::signal when no other event was pending.
+inline void first_signal() { first_signal_cycle.store(now(), std::memory_order::relaxed); }
+
+// Called by the main loop once it has taken the pending events.
+inline void woken_up() {
+    record(Point::EVENT_LATENCY, now() - first_signal_cycle.load(std::memory_order::relaxed));
+}
+
+inline void init() { logger::logger.init(); }
+
+// Called by the main loop on every tick.
+inline void report_if_due() {
+    static constinit uint32_t last_report = 0;
+    auto tick = HAL_GetTick();
+    if (tick - last_report < report_period_ms)
+        return;
+    last_report = tick;
+
+    constexpr const char* names[] = {
+        "can_receive",   "can_scheduler",  "uart_interrupt", "imu_read",
+        "usb_receive",   "downlink_parse", "usb_transmit",   "can_transmit",
+        "uart_transmit", "main_loop",      "event_latency",
+    };
+    static_assert(std::size(names) == std::size(stats));
+
+    logger::logger->printf("profile: cycles count/min/mean/max, log2 buckets from 2^6\n");
+    for (size_t i = 0; i < std::size(stats); i++) {
+        Stats entry;
+        {
+            utility::InterruptLockGuard guard;
+            entry    = stats[i];
+            stats[i] = {};
+        }
+        if (!entry.count)
+            continue;
+
+        auto mean = static_cast<uint32_t>(entry.total / entry.count);
+        logger::logger->printf(
+            "%s %u/%u/%u/%u |", names[i], static_cast<unsigned>(entry.count),
+            static_cast<unsigned>(entry.min), static_cast<unsigned>(mean),
+            static_cast<unsigned>(entry.max));
+        for (auto count : entry.histogram)
+            logger::logger->printf(" %u", static_cast<unsigned>(count));
+        logger::logger->printf("\n");
+    }
+}
+
+#else
+
+inline void record(Point, uint32_t) {}
+inline void first_signal() {}
+inline void woken_up() {}
+inline void init() {}
+inline void report_if_due() {}
+
+#endif
+
+#if defined(APP_PROFILER) || defined(APP_TRACE)
+
+class Scope {
+public:
+    explicit Scope(Point point)
+        : point_(point)
+        , start_(now()) {
+        logger::trace::write_at(
+            start_, logger::trace::Event::SCOPE_BEGIN, static_cast<uint16_t>(point_));
+    }
+    ~Scope() {
+        auto end = now();
+        record(point_, end - start_);
+        logger::trace::write_at(
+            end, logger::trace::Event::SCOPE_END, static_cast<uint16_t>(point_));
+    }
+
+private:
+    Point point_;
+    uint32_t start_;
+};
+
+#else
+
+class Scope {
+public:
+    explicit Scope(Point) {}
+};
+
+#endif
+
+} // namespace timer::profiler
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+#include <stm32f407xx.h>
+
+#include "app/timer/delay.hpp"
+#include "utility/interrupt_lock.hpp"
+
+// Wrapping microsecond timestamps of uplinked data, derived from the DWT cycle counter enabled in
+// main.c. The counter itself wraps every 25.6s, so the time is also advanced by HAL_IncTick every
+// millisecond to never miss a wrap.
+namespace timer::timestamp {
+
+constexpr uint32_t cycles_per_microsecond = system_frequency / 1'000'000;
+
+inline constinit uint32_t last_cycles = 0, microseconds = 0, remainder_cycles = 0;
+
+// Safe to call from any priority level.
+inline uint32_t now() {
+    utility::InterruptLockGuard guard;
+    auto cycles  = DWT->CYCCNT;
+    auto elapsed = cycles - last_cycles + remainder_cycles;
+    last_cycles  = cycles;
+
+    microseconds += elapsed / cycles_per_microsecond;
+    remainder_cycles = elapsed % cycles_per_microsecond;
+    return microseconds;
+}
+
+} // namespace timer::timestamp
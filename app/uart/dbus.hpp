@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace uart::dbus {
+
+// DR16 receivers send one frame every 14ms, as a single burst at 100000 baud 9E1.
+constexpr size_t frame_size = 18;
+
+constexpr uint16_t channel_min = 364, channel_max = 1684;
+
+// Decoded remote state, as uplinked in DBUS_ fields.
+struct __attribute__((packed)) State {
+    uint16_t channels[5];     // Sticks 0-3 and the wheel, 1024 centered
+    uint8_t switch_right : 2; // 1 up, 3 middle, 2 down
+    uint8_t switch_left  : 2;
+    bool mouse_left      : 1;
+    bool mouse_right     : 1;
+    uint8_t reserved     : 2;
+    int16_t mouse[3]; // x, y, z
+    uint16_t keyboard;
+
+    bool operator==(const State&) const = default;
+};
+
+// Decode a raw frame, return false if any stick or switch is out of range.
+inline bool decode(const std::byte (&frame)[frame_size], State& state) {
+    auto byte = [&frame](size_t index) { return static_cast<uint32_t>(frame[index]); };
+    auto word = [&byte](size_t index) {
+        return static_cast<uint16_t>(byte(index) | byte(index + 1) << 8);
+    };
+
+    state              = {};
+    state.channels[0]  = (byte(0) | byte(1) << 8) & 0x7FF;
+    state.channels[1]  = (byte(1) >> 3 | byte(2) << 5) & 0x7FF;
+    state.channels[2]  = (byte(2) >> 6 | byte(3) << 2 | byte(4) << 10) & 0x7FF;
+    state.channels[3]  = (byte(4) >> 1 | byte(5) << 7) & 0x7FF;
+    state.channels[4]  = word(16) & 0x7FF;
+    state.switch_right = (byte(5) >> 4) & 0b11;
+    state.switch_left  = (byte(5) >> 6) & 0b11;
+    for (size_t axis = 0; axis < 3; axis++)
+        state.mouse[axis] = static_cast<int16_t>(word(6 + 2 * axis));
+    state.mouse_left  = byte(12);
+    state.mouse_right = byte(13);
+    state.keyboard    = word(14);
+
+    // The wheel is reported as 0 by older receivers, so only the sticks are checked.
+    for (size_t channel = 0; channel < 4; channel++)
+        if (state.channels[channel] < channel_min || state.channels[channel] > channel_max)
+            return false;
+    return state.switch_right && state.switch_left;
+}
+
+} // namespace uart::dbus
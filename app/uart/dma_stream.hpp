@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <main.h>
+
+namespace uart {
+
+// A DMA stream together with the channel that routes its peripheral request to it. The stream is
+// kept as an address so that instances can be constant initialized.
+class DmaStream {
+public:
+    constexpr DmaStream(uintptr_t stream_base, uint32_t channel, IRQn_Type irqn)
+        : stream_base_(stream_base)
+        , channel_(channel)
+        , irqn_(irqn) {}
+
+    DMA_Stream_TypeDef* stream() const {
+        return reinterpret_cast<DMA_Stream_TypeDef*>(stream_base_);
+    }
+
+    uint32_t channel_select() const { return channel_ << DMA_SxCR_CHSEL_Pos; }
+
+    constexpr IRQn_Type irqn() const { return irqn_; }
+
+    void enable_clock() const {
+        if (controller() == DMA1)
+            __HAL_RCC_DMA1_CLK_ENABLE();
+        else
+            __HAL_RCC_DMA2_CLK_ENABLE();
+    }
+
+    // Interrupt flags of the stream, shifted to the positions of stream 0 (DMA_LISR_xxIF0).
+    uint32_t flags() const { return (*status_register() >> flag_shift()) & all_flags; }
+
+    void clear_flags(uint32_t flags = all_flags) const {
+        *clear_register() = flags << flag_shift();
+    }
+
+    static constexpr uint32_t all_flags =
+        DMA_LISR_FEIF0 | DMA_LISR_DMEIF0 | DMA_LISR_TEIF0 | DMA_LISR_HTIF0 | DMA_LISR_TCIF0;
+
+private:
+    // Streams are laid out every 0x18 bytes from offset 0x10 of their controller.
+    size_t index() const { return ((stream_base_ & 0xFF) - 0x10) / 0x18; }
+
+    DMA_TypeDef* controller() const {
+        return reinterpret_cast<DMA_TypeDef*>(stream_base_ & ~uintptr_t{0xFF});
+    }
+
+    // Streams 0-3 use the low registers and 4-7 the high ones, with the same layout.
+    uint32_t flag_shift() const {
+        constexpr uint32_t shifts[] = {0, 6, 16, 22};
+        return shifts[index() & 3];
+    }
+    volatile uint32_t* status_register() const {
+        return index() < 4 ? &controller()->LISR : &controller()->HISR;
+    }
+    volatile uint32_t* clear_register() const {
+        return index() < 4 ? &controller()->LIFCR : &controller()->HIFCR;
+    }
+
+    uintptr_t stream_base_;
+    uint32_t channel_;
+    IRQn_Type irqn_;
+};
+
+} // namespace uart
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "utility/crc.hpp"
+
+namespace uart::referee {
+
+// RoboMaster referee system frames: a header of {SOF 0xA5, uint16 data length, uint8 sequence,
+// CRC8 of the preceding bytes}, a uint16 command id, the data and a CRC16 of everything before.
+constexpr std::byte start_of_frame{0xA5};
+constexpr size_t header_size = 5, command_id_size = 2, tail_size = 2;
+
+// Longer frames are treated as corrupt headers.
+constexpr size_t max_frame_size = 128;
+
+inline uint16_t read_u16(const std::byte* data) {
+    return static_cast<uint16_t>(
+        static_cast<uint16_t>(data[0]) | static_cast<uint16_t>(data[1]) << 8);
+}
+
+// Size of the whole frame starting with header, or 0 if the header is corrupt.
+inline size_t frame_size(const std::byte (&header)[header_size]) {
+    if (header[0] != start_of_frame
+        || utility::crc::crc8(header, header_size - 1) != static_cast<uint8_t>(header[4]))
+        return 0;
+
+    size_t size = header_size + command_id_size + read_u16(&header[1]) + tail_size;
+    return size <= max_frame_size ? size : 0;
+}
+
+inline bool tail_valid(const std::byte* frame, size_t size) {
+    return utility::crc::crc16(frame, size - tail_size) == read_u16(&frame[size - tail_size]);
+}
+
+inline uint16_t command_id(const std::byte* frame) { return read_u16(&frame[header_size]); }
+
+} // namespace uart::referee
@@ -3,27 +3,78 @@
 #include <cstdint>
 #include <cstring>
 
+#include <algorithm>
 #include <atomic>
+#include <bit>
+#include <optional>
 
 #include <usart.h>
 
+#include "app/event.hpp"
 #include "app/led/led.hpp"
+#include "app/logger/trace.hpp"
+#include "app/timer/profiler.hpp"
+#include "app/timer/timestamp.hpp"
+#include "app/uart/dbus.hpp"
+#include "app/uart/dma_stream.hpp"
+#include "app/uart/referee.hpp"
+#include "app/usb/cdc.hpp"
 #include "app/usb/field.hpp"
 #include "app/usb/interrupt_safe_buffer.hpp"
 #include "utility/assert.hpp"
+#include "utility/interrupt_lock.hpp"
 #include "utility/lazy.hpp"
 
+namespace interfaces {
+template <IRQn_Type irqn>
+void handle_interrupt();
+}
+
 namespace uart {
 
 class Uart {
 public:
-    using Lazy = utility::Lazy<Uart, UART_HandleTypeDef*, size_t>;
+    // Peripheral resources of one port, listed in app/interfaces.hpp.
+    struct Config {
+        UART_HandleTypeDef* hal_uart_handle;
+        IRQn_Type irqn;
+        usb::field::UplinkId uplink_field_id;
+        uint16_t max_receive_size;
+        DmaStream receive_dma, transmit_dma;
+    };
 
-    explicit Uart(UART_HandleTypeDef* hal_uart_handle, uint16_t max_receive_size)
-        : hal_uart_handle_(hal_uart_handle)
-        , max_receive_size_(max_receive_size) {
-        assert_always(max_receive_size_ <= 64);
-        assert_always(trigger_hal_receive());
+    using Lazy = utility::Lazy<Uart, Config>;
+
+    explicit Uart(const Config& config)
+        : hal_uart_handle_(config.hal_uart_handle)
+        , uplink_field_id_(config.uplink_field_id)
+        , receive_dma_(config.receive_dma)
+        , transmit_dma_(config.transmit_dma) {
+        assert_always(config.max_receive_size && config.max_receive_size <= max_field_data_size);
+        default_framing_ = receive_framing_ = {
+            .mode = Framing::IDLE, .size = static_cast<uint8_t>(config.max_receive_size)};
+        default_format_ = current_format();
+
+        // The HAL handle is only used for initialization, both directions are driven by DMA and
+        // handled directly on the registers.
+        auto hal_uart_instance = hal_uart_handle_->Instance;
+
+        // Reception runs continuously into a circular buffer, whose new span is uplinked on idle
+        // line, half transfer and transfer complete.
+        auto receive_stream = setup_dma(receive_dma_, &hal_uart_instance->DR);
+        receive_stream->M0AR = reinterpret_cast<uintptr_t>(receive_buffer_);
+        receive_stream->NDTR = receive_buffer_size;
+        receive_stream->CR   = receive_dma_.channel_select() | DMA_SxCR_MINC | DMA_SxCR_CIRC
+                           | DMA_SxCR_HTIE | DMA_SxCR_TCIE;
+        receive_stream->CR |= DMA_SxCR_EN;
+        hal_uart_instance->CR3 |= USART_CR3_DMAR;
+        hal_uart_instance->CR1 |= USART_CR1_IDLEIE;
+
+        // Transmission is done one contiguous segment of the ring buffer at a time.
+        auto transmit_stream = setup_dma(transmit_dma_, &hal_uart_instance->DR);
+        transmit_stream->CR  = transmit_dma_.channel_select() | DMA_SxCR_MINC | DMA_SxCR_DIR_0
+                            | DMA_SxCR_TCIE | DMA_SxCR_TEIE;
+        hal_uart_instance->CR3 |= USART_CR3_DMAT;
     }
 
     bool read_buffer_write_device(std::byte*& buffer) {
@@ -34,69 +85,555 @@ public:
         if (!size)
             size = static_cast<uint8_t>(*buffer++);
 
-        auto& transmit_buffer = transmit_buffers_[buffer_writing_.load(std::memory_order::relaxed)];
-        uint8_t written_size  = transmit_buffer.written_size.load(std::memory_order::relaxed);
-
-        uint8_t size_allowed = size;
-        if (size_allowed > sizeof(transmit_buffer.data) - written_size)
-            size_allowed = sizeof(transmit_buffer.data) - written_size;
-
-        transmit_buffer.written_size.store(written_size + size_allowed, std::memory_order::relaxed);
-        std::memcpy(&transmit_buffer.data[written_size], buffer, size_allowed);
+        bool completed = write_stream(buffer, size) == size;
         buffer += size;
 
-        bool completed = size_allowed == size;
         if (!completed) [[unlikely]]
             led::led->downlink_buffer_full();
         return completed;
     }
 
-    bool try_transmit() {
-        // Under normal circumstances, the trigger_hal_receive function is called within the
-        // interrupt service routine (ISR). However, if the ISR fails to execute for any reason, the
-        // UART will stop receiving data. Therefore, it is necessary to compensate for this
-        // situation by using polling. If the UART is idle, receiving should be triggered again.
-        if (device_reception_ready()) [[unlikely]]
-            trigger_hal_receive();
-
-        auto writing = buffer_writing_.load(std::memory_order::relaxed);
-        if (transmit_buffers_[writing].written_size.load(std::memory_order::relaxed) == 0)
+    // Append data to the transmit buffer as far as it fits, return the number of bytes taken.
+    size_t write_stream(const std::byte* data, size_t size) {
+        auto in = transmit_in_.load(std::memory_order::relaxed);
+        size    = std::min(size, transmit_writeable());
+
+        auto offset = in & transmit_buffer_mask;
+        auto slice  = std::min(size, transmit_buffer_size - offset);
+        std::memcpy(&transmit_buffer_[offset], data, slice);
+        std::memcpy(&transmit_buffer_[0], data + slice, size - slice);
+
+        std::atomic_signal_fence(std::memory_order::release);
+        transmit_in_.store(in + size, std::memory_order::relaxed);
+
+        return size;
+    }
+
+    // A UART field with an explicit size byte of 0 is followed by a 16-bit length instead, and its
+    // data is streamed: it runs to the end of the packet and continues at the start of the next
+    // ones. Return that length, or 0 if the field at buffer (at least downlink_field_size bytes) is
+    // a regular one.
+    static size_t stream_length(const std::byte* buffer) {
+        auto& header = *std::launder(reinterpret_cast<const StreamHeader*>(buffer));
+        if (header.field.data_size || header.size)
+            return 0;
+        return header.length;
+    }
+
+    // Size of the downlink UART field at buffer, or 0 if it exceeds the available bytes.
+    static size_t downlink_field_size(const std::byte* buffer, size_t available) {
+        if (available < sizeof(FieldHeader))
+            return 0;
+
+        auto& header = *std::launder(reinterpret_cast<const FieldHeader*>(buffer));
+        size_t size  = sizeof(FieldHeader) + header.data_size;
+        if (!header.data_size) {
+            if (available < sizeof(FieldHeader) + 1)
+                return 0;
+            size += 1 + static_cast<uint8_t>(buffer[sizeof(FieldHeader)]);
+            if (size == sizeof(FieldHeader) + 1)
+                size = sizeof(StreamHeader);
+        }
+
+        return size <= available ? size : 0;
+    }
+
+    // Check whether the field at buffer can be forwarded without being truncated.
+    bool device_writeable(const std::byte* buffer) const {
+        auto& header = *std::launder(reinterpret_cast<const FieldHeader*>(buffer));
+        size_t size  = header.data_size;
+        if (!size)
+            size = static_cast<uint8_t>(buffer[sizeof(FieldHeader)]);
+
+        // Fields larger than the whole buffer are never going to fit, let them be truncated.
+        return size <= transmit_writeable() || size > transmit_buffer_size;
+    }
+
+    // Values of the CR1 PCE and PS bits.
+    enum class Parity : uint8_t { NONE = 0, EVEN = 2, ODD = 3 };
+
+    // Values of the CR2 STOP bits.
+    enum class StopBits : uint8_t { ONE = 0, HALF = 1, TWO = 2, ONE_AND_HALF = 3 };
+
+    // Request a new line format, applied once the data queued so far has been transmitted. Return
+    // false if it can not be achieved. With 7 data bits, the parity bit is received as bit 7.
+    bool set_format(uint32_t baud_rate, uint8_t data_bits, Parity parity, StopBits stop_bits) {
+        bool parity_enabled = parity != Parity::NONE;
+        if (static_cast<uint8_t>(parity) == 1)
+            return false;
+        if (!(data_bits == 8 || (data_bits == 7 && parity_enabled)))
             return false;
 
-        if (!device_transmission_ready())
+        auto instance = hal_uart_handle_->Instance;
+        uint32_t pclk = (instance == USART1 || instance == USART6) ? HAL_RCC_GetPCLK2Freq()
+                                                                   : HAL_RCC_GetPCLK1Freq();
+        // The divider mantissa has 12 bits, oversampling by 8 doubles the maximum baud rate.
+        if (baud_rate <= pclk / (16 * 4096) || baud_rate > pclk / 8)
             return false;
 
-        transmit_buffers_[!writing].written_size.store(0, std::memory_order::relaxed);
-        std::atomic_signal_fence(std::memory_order::release);
-        buffer_writing_.store(!writing, std::memory_order::relaxed);
-        std::atomic_signal_fence(std::memory_order::release);
+        Format format;
+        format.cr1 = (parity_enabled ? USART_CR1_PCE : 0)
+                   | (parity == Parity::ODD ? USART_CR1_PS : 0)
+                   | (data_bits + parity_enabled > 8 ? USART_CR1_M : 0);
+        if (baud_rate > pclk / 16) {
+            format.cr1 |= USART_CR1_OVER8;
+            format.brr = UART_BRR_SAMPLING8(pclk, baud_rate);
+        } else {
+            format.brr = UART_BRR_SAMPLING16(pclk, baud_rate);
+        }
+        format.cr2 = static_cast<uint32_t>(stop_bits) << USART_CR2_STOP_Pos;
+
+        pending_format_ = format;
+        return true;
+    }
 
-        // Note: Must read written_size again here to avoid data loss.
-        assert_always(
-            HAL_UART_Transmit_IT(
-                hal_uart_handle_, reinterpret_cast<uint8_t*>(transmit_buffers_[writing].data),
-                transmit_buffers_[writing].written_size.load(std::memory_order::relaxed))
-            == HAL_OK);
+    // Restore the format set up by CubeMX. Re-enabling the USART would abort a character being
+    // received and hold back downlink fields until the transmit ring drains, so an unchanged
+    // format is left as it is.
+    void reset_format() {
+        if (default_format_ == current_format()) {
+            pending_format_.reset();
+            return;
+        }
+        pending_format_ = default_format_;
+    }
+
+    // Downlink data must not be queued while a format change is pending, or it would be
+    // transmitted in the previous format.
+    bool format_pending() const { return pending_format_.has_value(); }
+
+    // How received data is cut into uplink fields. Fields are never larger than the framing size,
+    // longer frames are split.
+    enum class Framing : uint8_t {
+        IDLE               = 0, // Cut at idle line and every half of the receive buffer
+        FIXED_LENGTH       = 1, // Fields of exactly the framing size
+        LEADING_DELIMITER  = 2, // Each field starts at a delimiter byte, like a start of frame
+        TRAILING_DELIMITER = 3, // Each field ends with a delimiter byte, like a line feed
+        DBUS               = 4, // Decode DR16 remote frames into DBUS_ fields
+        DBUS_ON_CHANGE     = 5, // As DBUS, but skip frames equal to the last uplinked one
+        REFEREE            = 6, // Whole referee system frames, see set_referee_filter
+    };
 
+    // Except in IDLE framing, data not forming a complete field is held until more arrives, or for
+    // at most latency milliseconds (0 to hold it indefinitely). FIXED_LENGTH with a latency thus
+    // batches up to size bytes with bounded delay.
+    // In DBUS framing, size and delimiter are unused and latency is the time without a valid frame
+    // after which the remote is reported lost.
+    // In REFEREE framing, frames with valid CRCs are uplinked as consecutive fields of at most
+    // size bytes each, other data is dropped. Delimiter and latency are unused.
+    bool set_framing(Framing mode, uint8_t size, std::byte delimiter, uint16_t latency) {
+        if (mode > Framing::REFEREE)
+            return false;
+        if (is_dbus(mode) ? !latency : !size || size > max_field_data_size)
+            return false;
+
+        apply_framing({.mode = mode, .size = size, .delimiter = delimiter, .latency = latency});
         return true;
     }
 
+    void reset_framing() {
+        apply_framing(default_framing_);
+        for (size_t index = 0; index < referee_filter_count; index++)
+            set_referee_filter(index, 0);
+    }
+
+    // Referee frames are only uplinked if their command id is in one of the filter slots, or if all
+    // slots are cleared (command id 0).
+    static constexpr size_t referee_filter_count = 8;
+
+    bool set_referee_filter(size_t index, uint16_t command_id) {
+        if (index >= referee_filter_count)
+            return false;
+
+        utility::InterruptLockGuard guard;
+        referee_filter_[index] = command_id;
+        return true;
+    }
+
+    // Start transmitting queued data if the DMA is idle, further segments are chained from its
+    // transfer complete interrupt.
+    bool try_transmit() {
+        timer::profiler::Scope profile{timer::profiler::Point::UART_TRANSMIT};
+        flush_expired_receive();
+
+        if (transmitting_.load(std::memory_order::relaxed))
+            return false;
+
+        if (pending_format_
+            && transmit_in_.load(std::memory_order::relaxed)
+                   == transmit_out_.load(std::memory_order::relaxed)) [[unlikely]] {
+            // Wait for the last stop bit, the receive DMA keeps running across the change.
+            if (!(hal_uart_handle_->Instance->SR & USART_SR_TC)) {
+                event::signal(event::DOWNLINK);
+                return false;
+            }
+            apply_format(*pending_format_);
+            pending_format_.reset();
+            return false;
+        }
+
+        return start_transmit_segment();
+    }
+
 private:
-    friend void ::HAL_UARTEx_RxEventCallback(UART_HandleTypeDef*, uint16_t);
+    template <IRQn_Type irqn>
+    friend void interfaces::handle_interrupt();
+
+    static DMA_Stream_TypeDef* setup_dma(const DmaStream& dma, volatile uint32_t* data_register) {
+        dma.enable_clock();
+        auto stream = dma.stream();
+        stream->CR &= ~DMA_SxCR_EN;
+        while (stream->CR & DMA_SxCR_EN)
+            ;
+        stream->PAR = reinterpret_cast<uintptr_t>(data_register);
+        dma.clear_flags();
+
+        HAL_NVIC_EnableIRQ(dma.irqn());
+        return stream;
+    }
+
+    // Called by USARTx_IRQHandler in place of HAL_UART_IRQHandler.
+    void irq_handler(usb::InterruptSafeBuffer& buffer_wrapper) {
+        timer::profiler::Scope profile{timer::profiler::Point::UART_INTERRUPT};
+        auto hal_uart_instance = hal_uart_handle_->Instance;
+        if (hal_uart_instance->SR & USART_SR_IDLE) {
+            // IDLE is cleared by reading DR after SR.
+            (void)hal_uart_instance->DR;
+            read_device_write_buffer(buffer_wrapper, ReceiveEvent::IDLE_LINE);
+        }
+    }
 
-    bool device_transmission_ready() { return hal_uart_handle_->gState == HAL_UART_STATE_READY; }
-    bool device_reception_ready() { return hal_uart_handle_->RxState == HAL_UART_STATE_READY; }
+    // Called by the receive DMA stream interrupt on half transfer and transfer complete.
+    void dma_receive_irq_handler(usb::InterruptSafeBuffer& buffer_wrapper) {
+        timer::profiler::Scope profile{timer::profiler::Point::UART_INTERRUPT};
+        receive_dma_.clear_flags(receive_dma_.flags());
+        read_device_write_buffer(buffer_wrapper, ReceiveEvent::HALF_BUFFER);
+    }
+
+    // Called by the transmit DMA stream interrupt. A transfer error stops the stream as well, the
+    // segment is dropped in that case.
+    void dma_transmit_irq_handler() {
+        timer::profiler::Scope profile{timer::profiler::Point::UART_INTERRUPT};
+        auto flags = transmit_dma_.flags();
+        transmit_dma_.clear_flags(flags);
+        if (!(flags & (DMA_LISR_TCIF0 | DMA_LISR_TEIF0)))
+            return;
+
+        transmit_out_.store(
+            transmit_out_.load(std::memory_order::relaxed) + transmit_segment_size_,
+            std::memory_order::relaxed);
+        start_transmit_segment();
+    }
+
+    // Called by the main loop when idle, or by the DMA interrupt to chain the next segment.
+    bool start_transmit_segment() {
+        auto in  = transmit_in_.load(std::memory_order::relaxed);
+        auto out = transmit_out_.load(std::memory_order::relaxed);
+        if (in == out) {
+            transmitting_.store(false, std::memory_order::relaxed);
+            event::signal(event::DOWNLINK); // A pending format waits for the ring to drain
+            return false;
+        }
+        std::atomic_signal_fence(std::memory_order::acquire);
+
+        // Stop at the end of the buffer, the wrapped part becomes the next segment.
+        auto offset            = out & transmit_buffer_mask;
+        transmit_segment_size_ = std::min(in - out, transmit_buffer_size - offset);
+        transmitting_.store(true, std::memory_order::relaxed);
+
+        auto stream  = transmit_dma_.stream();
+        stream->M0AR = reinterpret_cast<uintptr_t>(&transmit_buffer_[offset]);
+        stream->NDTR = transmit_segment_size_;
+        // TC stays set from the previous segment or reset, it only means that the last stop bit of
+        // this segment went out once cleared here.
+        hal_uart_handle_->Instance->SR = ~USART_SR_TC;
+        stream->CR |= DMA_SxCR_EN;
+        return true;
+    }
 
-    bool read_device_write_buffer(
-        usb::InterruptSafeBuffer& buffer_wrapper, usb::field::UplinkId field_id, uint16_t size) {
-        assert(size);
+    struct Format {
+        uint32_t brr;
+        uint32_t cr1; // Within format_cr1_mask
+        uint32_t cr2; // Within USART_CR2_STOP
 
+        bool operator==(const Format&) const = default;
+    };
+    static constexpr uint32_t format_cr1_mask =
+        USART_CR1_OVER8 | USART_CR1_M | USART_CR1_PCE | USART_CR1_PS;
+
+    Format current_format() const {
+        auto instance = hal_uart_handle_->Instance;
+        Format format;
+        format.brr = instance->BRR;
+        format.cr1 = instance->CR1 & format_cr1_mask;
+        format.cr2 = instance->CR2 & USART_CR2_STOP;
+        return format;
+    }
+
+    // Called by the main loop once transmission is complete. Disabling the USART aborts a
+    // character being received, which is lost anyway as the sender changes format too.
+    void apply_format(const Format& format) {
+        auto instance = hal_uart_handle_->Instance;
+        instance->CR1 &= ~USART_CR1_UE;
+        instance->BRR = format.brr;
+        instance->CR2 = (instance->CR2 & ~USART_CR2_STOP) | format.cr2;
+        instance->CR1 = (instance->CR1 & ~format_cr1_mask) | format.cr1;
+        instance->CR1 |= USART_CR1_UE;
+    }
+
+    size_t transmit_writeable() const {
+        return transmit_buffer_size
+             - (transmit_in_.load(std::memory_order::relaxed)
+                - transmit_out_.load(std::memory_order::relaxed));
+    }
+
+    static constexpr bool is_dbus(Framing mode) {
+        return mode == Framing::DBUS || mode == Framing::DBUS_ON_CHANGE;
+    }
+
+    enum class ReceiveEvent : uint8_t {
+        IDLE_LINE,
+        HALF_BUFFER, // Half transfer or transfer complete
+        FLUSH,       // Uplink incomplete fields too
+    };
+
+    struct ReceiveFraming {
+        Framing mode;
+        uint8_t size;
+        std::byte delimiter = std::byte{0};
+        uint16_t latency    = 0;
+    };
+
+    // Called by the main loop. Data held with the previous framing is uplinked as it is.
+    void apply_framing(const ReceiveFraming& framing) {
+        utility::InterruptLockGuard guard;
+        read_device_write_buffer(usb::cdc->get_transmit_buffer(), ReceiveEvent::FLUSH);
+        receive_framing_ = framing;
+        dbus_lost_.store(true, std::memory_order::relaxed);
+    }
+
+    // Called by the main loop to uplink held data once it is older than the framing latency, or
+    // to report the DBUS remote lost.
+    void flush_expired_receive() {
+        bool dbus = is_dbus(receive_framing_.mode);
+        if (!(dbus ? !dbus_lost_.load(std::memory_order::relaxed)
+                   : receive_held_.load(std::memory_order::relaxed)))
+            return;
+
+        utility::InterruptLockGuard guard;
+        auto latency = receive_framing_.latency;
+        if (dbus) {
+            if (!dbus_lost_.load(std::memory_order::relaxed)
+                && HAL_GetTick() - dbus_frame_tick_ >= latency) {
+                dbus_lost_.store(true, std::memory_order::relaxed);
+                write_dbus_field(usb::cdc->get_transmit_buffer(), timer::timestamp::now());
+            }
+        } else if (latency && HAL_GetTick() - receive_held_tick_ >= latency) {
+            read_device_write_buffer(usb::cdc->get_transmit_buffer(), ReceiveEvent::FLUSH);
+        }
+    }
+
+    // A DBUS frame is valid if it arrives as one burst of the exact size between idle lines. Any
+    // other received data is dropped.
+    void read_dbus_frame(
+        usb::InterruptSafeBuffer& buffer_wrapper, ReceiveEvent event, size_t pending) {
+        if (event == ReceiveEvent::HALF_BUFFER && pending <= dbus::frame_size)
+            return;
+
+        std::byte frame[dbus::frame_size];
+        for (size_t index = 0; index < dbus::frame_size; index++)
+            frame[index] = receive_buffer_[(receive_out_ + index) & receive_buffer_mask];
+        receive_out_ = (receive_out_ + pending) & receive_buffer_mask;
+
+        dbus::State state;
+        if (event != ReceiveEvent::IDLE_LINE || pending != dbus::frame_size
+            || !dbus::decode(frame, state))
+            return;
+
+        dbus_frame_tick_ = HAL_GetTick();
+        bool recovered   = dbus_lost_.exchange(false, std::memory_order::relaxed);
+        if (receive_framing_.mode == Framing::DBUS_ON_CHANGE && !recovered && state == dbus_state_)
+            return;
+        dbus_state_ = state;
+        write_dbus_field(buffer_wrapper, timer::timestamp::now());
+    }
+
+    bool write_dbus_field(usb::InterruptSafeBuffer& buffer_wrapper, uint32_t timestamp) {
+        struct __attribute__((packed)) DbusField {
+            uint8_t field_id : 4; // UplinkId::DBUS_
+            bool lost        : 1; // No valid frame within the latency, state is the last one
+            uint8_t reserved : 3;
+            uint32_t timestamp;   // Microseconds, wrapping
+            dbus::State state;
+        };
+
+        auto buffer = buffer_wrapper.allocate(sizeof(DbusField));
+        if (buffer) {
+            auto& field     = *new (buffer) DbusField{};
+            field.field_id  = static_cast<uint8_t>(usb::field::UplinkId::DBUS_);
+            field.lost      = dbus_lost_.load(std::memory_order::relaxed);
+            field.timestamp = timestamp;
+            field.state     = dbus_state_;
+        }
+
+        return static_cast<bool>(buffer);
+    }
+
+    // Size of the next field within the pending received data, or 0 if it is incomplete.
+    size_t next_field_size(size_t pending) const {
+        size_t limit = std::min<size_t>(pending, receive_framing_.size);
+        auto at      = [this](size_t index) {
+            return receive_buffer_[(receive_out_ + index) & receive_buffer_mask];
+        };
+
+        if (receive_framing_.mode == Framing::LEADING_DELIMITER) {
+            for (size_t index = 1; index < limit; index++)
+                if (at(index) == receive_framing_.delimiter)
+                    return index;
+        } else if (receive_framing_.mode == Framing::TRAILING_DELIMITER) {
+            for (size_t index = 0; index < limit; index++)
+                if (at(index) == receive_framing_.delimiter)
+                    return index + 1;
+        }
+        return pending >= receive_framing_.size ? receive_framing_.size : 0;
+    }
+
+    // Uplink the data received by DMA since the last call as fields cut by the framing, including
+    // an incomplete last one in IDLE framing or on FLUSH. Only called from the USART and DMA
+    // interrupts, which share one priority, or with interrupts disabled, so it is never reentered.
+    void read_device_write_buffer(usb::InterruptSafeBuffer& buffer_wrapper, ReceiveEvent event) {
+        size_t position = (receive_buffer_size - receive_dma_.stream()->NDTR) & receive_buffer_mask;
+        size_t pending  = (position - receive_out_) & receive_buffer_mask;
+        if (is_dbus(receive_framing_.mode)) [[unlikely]] {
+            read_dbus_frame(buffer_wrapper, event, pending);
+            return;
+        } else if (receive_framing_.mode == Framing::REFEREE) [[unlikely]] {
+            read_referee_frames(buffer_wrapper, event, pending);
+            return;
+        }
+
+        bool flush    = event == ReceiveEvent::FLUSH || receive_framing_.mode == Framing::IDLE;
+        bool advanced = false;
+
+        while (pending) {
+            size_t size = next_field_size(pending);
+            if (!size) {
+                if (!flush)
+                    break;
+                size = std::min<size_t>(pending, receive_framing_.size);
+            }
+            write_field(buffer_wrapper, size);
+            receive_out_ = (receive_out_ + size) & receive_buffer_mask;
+            pending -= size;
+            advanced = true;
+        }
+
+        // The latency counts from when the oldest held byte was first seen.
+        if (pending && (advanced || !receive_held_.load(std::memory_order::relaxed)))
+            receive_held_tick_ = HAL_GetTick();
+        receive_held_.store(pending != 0, std::memory_order::relaxed);
+    }
+
+    // Copy size bytes of the receive buffer, starting at the oldest pending one.
+    void copy_received(std::byte* destination, size_t size) const {
+        auto slice = std::min(size, receive_buffer_size - receive_out_);
+        std::memcpy(destination, &receive_buffer_[receive_out_], slice);
+        std::memcpy(destination + slice, &receive_buffer_[0], size - slice);
+    }
+
+    bool write_field(usb::InterruptSafeBuffer& buffer_wrapper, size_t size) {
+        auto data = allocate_field(buffer_wrapper, size);
+        if (data)
+            copy_received(data, size);
+        return static_cast<bool>(data);
+    }
+
+    // Search the pending data for referee frames, skipping one byte at a time until a valid one is
+    // found. An incomplete frame is kept for the next call, except on FLUSH.
+    void read_referee_frames(
+        usb::InterruptSafeBuffer& buffer_wrapper, ReceiveEvent event, size_t pending) {
+        auto skip = [this, &pending](size_t size) {
+            receive_out_ = (receive_out_ + size) & receive_buffer_mask;
+            pending -= size;
+        };
+
+        std::byte frame[referee::max_frame_size];
+        while (pending >= referee::header_size) {
+            if (receive_buffer_[receive_out_] != referee::start_of_frame) {
+                skip(1);
+                continue;
+            }
+
+            std::byte header[referee::header_size];
+            copy_received(header, sizeof(header));
+            size_t size = referee::frame_size(header);
+            if (!size) {
+                skip(1);
+                continue;
+            }
+            if (pending < size)
+                break;
+
+            copy_received(frame, size);
+            if (!referee::tail_valid(frame, size)) {
+                skip(1);
+                continue;
+            }
+            if (referee_command_selected(referee::command_id(frame)))
+                write_sliced_frame(buffer_wrapper, frame, size);
+            skip(size);
+        }
+
+        if (event == ReceiveEvent::FLUSH)
+            skip(pending);
+    }
+
+    // Uplink a frame as fields of at most the framing size, either all of them or none, so the
+    // host never receives a torn frame.
+    void write_sliced_frame(
+        usb::InterruptSafeBuffer& buffer_wrapper, const std::byte* frame, size_t size) {
+        size_t slice_size  = receive_framing_.size;
+        size_t field_count = (size + slice_size - 1) / slice_size;
+        auto field_size    = [&](size_t index) {
+            auto slice = std::min(size - index * slice_size, slice_size);
+            return sizeof(FieldHeader) + (slice > 15) + slice;
+        };
+
+        // No other producer can allocate between the check and the allocations.
+        utility::InterruptLockGuard guard;
+        if (!buffer_wrapper.allocatable(field_count, field_size)) [[unlikely]] {
+            led::led->uplink_buffer_full();
+            return;
+        }
+        for (size_t offset = 0; offset < size; offset += slice_size) {
+            auto slice = std::min(size - offset, slice_size);
+            auto data  = allocate_field(buffer_wrapper, slice);
+            assert_always(data);
+            std::memcpy(data, &frame[offset], slice);
+        }
+    }
+
+    bool referee_command_selected(uint16_t command_id) const {
+        bool filtered = false;
+        for (auto selected : referee_filter_) {
+            if (selected == command_id)
+                return true;
+            filtered |= selected != 0;
+        }
+        return !filtered;
+    }
+
+    // Allocate an uplink field for size bytes of received data, and return where the data goes.
+    std::byte* allocate_field(usb::InterruptSafeBuffer& buffer_wrapper, size_t size) {
         std::byte* buffer = buffer_wrapper.allocate(sizeof(FieldHeader) + (size > 15) + size);
+        logger::trace::write(
+            logger::trace::Event::UART_RECEIVED, static_cast<uint16_t>(uplink_field_id_), size,
+            buffer != nullptr);
         if (buffer) {
             // Write field header
             auto& header = *new (buffer) FieldHeader{};
             buffer += sizeof(FieldHeader);
-            header.field_id = static_cast<uint8_t>(field_id);
+            header.field_id = static_cast<uint8_t>(uplink_field_id_);
             if (size <= 15) {
                 // Store 4-bit size and field-id together
                 header.data_size = size;
@@ -105,42 +642,68 @@ private:
                 header.data_size = 0;
                 *(buffer++)      = static_cast<std::byte>(size);
             }
-
-            // Write received data
-            std::memcpy(buffer, receive_buffer_, size);
-            buffer += size;
         }
 
-        assert_always(trigger_hal_receive());
-
-        return static_cast<bool>(buffer);
-    }
-
-    bool trigger_hal_receive() {
-        return HAL_UARTEx_ReceiveToIdle_IT(
-                   hal_uart_handle_, reinterpret_cast<uint8_t*>(receive_buffer_), max_receive_size_)
-            == HAL_OK;
+        return buffer;
     }
 
     UART_HandleTypeDef* hal_uart_handle_;
+    usb::field::UplinkId uplink_field_id_;
 
     struct __attribute__((packed)) FieldHeader {
         uint8_t field_id  : 4;
         uint8_t data_size : 4;
     };
 
-    std::byte receive_buffer_[64];
-    uint16_t max_receive_size_;
+    struct __attribute__((packed)) StreamHeader {
+        FieldHeader field; // data_size = 0
+        uint8_t size;      // 0
+        uint16_t length;
+    };
 
-    struct {
-        std::atomic<uint8_t> written_size = 0;
-        std::byte data[128];
-    } transmit_buffers_[2];
-    std::atomic<uint8_t> buffer_writing_ = 0;
+    static constexpr size_t receive_buffer_size = 256;
+    static constexpr size_t receive_buffer_mask = receive_buffer_size - 1;
+    static_assert(std::has_single_bit(receive_buffer_size));
+
+    // Fields must fit into an uplink batch together with its header.
+    static constexpr size_t max_field_data_size = 48;
+    static_assert(max_field_data_size < receive_buffer_size / 2);
+    static_assert(referee::max_frame_size <= receive_buffer_size / 2);
+    static_assert(
+        max_field_data_size + 2 + usb::InterruptSafeBuffer::max_reserved_size
+        <= usb::InterruptSafeBuffer::batch_size);
+
+    std::byte receive_buffer_[receive_buffer_size];
+    size_t receive_out_ = 0;
+    std::atomic<bool> receive_held_ = false;
+    uint32_t receive_held_tick_     = 0;
+    DmaStream receive_dma_;
+
+    // Written by the main loop with interrupts disabled.
+    ReceiveFraming default_framing_, receive_framing_;
+
+    uint16_t referee_filter_[referee_filter_count]{};
+
+    dbus::State dbus_state_{};
+    std::atomic<bool> dbus_lost_ = true;
+    uint32_t dbus_frame_tick_    = 0;
+
+    // Produced by the main loop while parsing downlink fields, consumed by the transmit DMA.
+    static constexpr size_t transmit_buffer_size = 1024;
+    static constexpr size_t transmit_buffer_mask = transmit_buffer_size - 1;
+    static_assert(std::has_single_bit(transmit_buffer_size));
+
+    std::byte transmit_buffer_[transmit_buffer_size];
+    std::atomic<size_t> transmit_in_  = 0;
+    std::atomic<size_t> transmit_out_ = 0;
+    std::atomic<bool> transmitting_   = false;
+    size_t transmit_segment_size_     = 0;
+
+    DmaStream transmit_dma_;
+
+    // Only accessed by the main loop.
+    Format default_format_;
+    std::optional<Format> pending_format_;
 };
 
-inline constinit Uart::Lazy uart1{&huart6, 15};
-inline constinit Uart::Lazy uart2{&huart1, 15};
-inline constinit Uart::Lazy uart_dbus{&huart3, 31};
-
 } // namespace uart
@@ -1,13 +1,30 @@
 #include "cdc.hpp"
 
+#include <array>
+#include <utility>
+
 #include "app/can/can.hpp"
+#include "app/event.hpp"
+#include "app/interfaces.hpp"
+#include "app/logger/trace.hpp"
 #include "app/uart/uart.hpp"
 #include "app/usb/field.hpp"
+#include "utility/interrupt_lock.hpp"
 
 namespace usb {
 
 inline int8_t hal_cdc_init_callback() {
-    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, reinterpret_cast<uint8_t*>(Cdc::receive_buffer_));
+    // The class driver arms the OUT endpoint by itself on (re)enumeration, so a free packet must be
+    // provided even if reception was stalled. In that case the newest pending packet is dropped,
+    // which the main loop is not parsing as at least two are pending.
+    auto in = cdc->receive_in_.load(std::memory_order::relaxed);
+    if (in - cdc->receive_out_.load(std::memory_order::relaxed) == Cdc::receive_packet_count)
+        cdc->receive_in_.store(--in, std::memory_order::relaxed);
+    cdc->receive_stalled_.store(false, std::memory_order::relaxed);
+
+    USBD_CDC_SetRxBuffer(
+        &hUsbDeviceFS,
+        reinterpret_cast<uint8_t*>(Cdc::receive_packets_[in & Cdc::receive_packet_mask].data));
     return USBD_OK;
 }
 
@@ -17,45 +34,441 @@ inline int8_t hal_cdc_control_callback(uint8_t command, uint8_t* buffer, uint16_
     return USBD_OK;
 }
 
-// NOLINTNEXTLINE(readability-non-const-parameter) because bullshit HAL api.
-inline int8_t hal_cdc_receive_callback(uint8_t* buffer, uint32_t* length) {
-    auto iterator = reinterpret_cast<std::byte*>(buffer);
-    assert(iterator == Cdc::receive_buffer_);
+Cdc::FieldResult Cdc::read_control_field(std::byte*& buffer, const std::byte* sentinel) {
+    enum class Command : uint8_t {
+        CONNECT              = 0,  // Clear uplink buffer, reset alarm and configuration
+        FLOW_CONTROL         = 1,  // Followed by one byte: non-zero to enable flow control
+        CAN_BUS_OFF_RECOVERY = 2,  // Followed by CanBusOffRecovery
+        CAN_PERIODIC_SET     = 3,  // Followed by CanPeriodicSet and a CAN field if period != 0
+        CAN_PERIODIC_PATCH   = 4,  // Followed by CanPeriodicSlot and the new payload
+        CAN_BRIDGE_SET       = 5,  // Followed by CanBridgeSet
+        CAN_BIT_TIMING       = 6,  // Followed by CanBitTiming
+        UART_FORMAT          = 7,  // Followed by UartFormat
+        UART_FRAMING         = 8,  // Followed by UartFraming
+        UART_REFEREE_FILTER  = 9,  // Followed by UartRefereeFilter
+        UPLINK_INTEGRITY     = 10, // Followed by one byte: Cdc::UplinkIntegrity
+    };
+    struct __attribute__((packed)) FieldHeader {
+        uint8_t field_id : 4;
+        Command command  : 4;
+    };
+    struct __attribute__((packed)) CanBusOffRecovery {
+        field::DownlinkId can_field_id : 4;
+        uint8_t reserved               : 4;
+        uint16_t delay; // Milliseconds, 0xFFFF to stay bus-off until reconfigured
+    };
+    struct __attribute__((packed)) CanPeriodicSlot {
+        field::DownlinkId can_field_id : 4;
+        uint8_t slot_index             : 4;
+    };
+    struct __attribute__((packed)) CanPeriodicSet {
+        CanPeriodicSlot slot;
+        uint32_t period; // Microseconds, 0 to clear the slot
+        uint32_t phase;  // Microseconds until the first transmission
+    };
+    struct __attribute__((packed)) CanBridgeSet {
+        field::DownlinkId source_field_id : 4;
+        uint8_t rule_index                : 4;
+        field::DownlinkId target_field_id : 4; // CONTROL_ to clear the rule
+        bool is_extended_can_id           : 1;
+        bool forward_to_host              : 1;
+        uint8_t reserved                  : 2;
+        uint32_t match_id, match_mask;
+        uint32_t rewrite_id, rewrite_mask;
+    };
+    struct __attribute__((packed)) CanBitTiming {
+        field::DownlinkId can_field_id : 4;
+        uint8_t reserved               : 4;
+        uint32_t bitrate;      // Bit/s
+        uint16_t sample_point; // Per mille
+    };
+    struct __attribute__((packed)) UartFormat {
+        field::DownlinkId uart_field_id : 4;
+        uint8_t data_bits               : 4; // 8, or 7 with parity
+        uart::Uart::Parity parity       : 2;
+        uart::Uart::StopBits stop_bits  : 2;
+        uint8_t reserved                : 4;
+        uint32_t baud_rate;
+    };
+    struct __attribute__((packed)) UartFraming {
+        field::DownlinkId uart_field_id : 4;
+        uart::Uart::Framing mode        : 4;
+        uint8_t size; // Fixed or maximum field size
+        std::byte delimiter;
+        uint16_t latency; // Milliseconds, 0 to hold incomplete fields indefinitely
+    };
+    struct __attribute__((packed)) UartRefereeFilter {
+        field::DownlinkId uart_field_id : 4;
+        uint8_t slot_index              : 4;
+        uint16_t command_id; // 0 to clear the slot
+    };
+
+    // Fixed part of each command, indexed by command.
+    constexpr size_t payload_sizes[] = {
+        0,
+        1,
+        sizeof(CanBusOffRecovery),
+        sizeof(CanPeriodicSet),
+        sizeof(CanPeriodicSlot),
+        sizeof(CanBridgeSet),
+        sizeof(CanBitTiming),
+        sizeof(UartFormat),
+        sizeof(UartFraming),
+        sizeof(UartRefereeFilter),
+        1};
+
+    auto header  = std::bit_cast<FieldHeader>(*buffer);
+    auto command = static_cast<size_t>(header.command);
+    if (command >= std::size(payload_sizes))
+        return FieldResult::UNKNOWN;
+    if (static_cast<size_t>(sentinel - buffer) < sizeof(FieldHeader) + payload_sizes[command])
+        return FieldResult::MALFORMED;
+    buffer += sizeof(FieldHeader);
+
+    if (header.command == Command::CONNECT) {
+        flow_control_enabled_.store(false, std::memory_order::relaxed);
+        for (auto& entry : interfaces::cans) {
+            auto& can = **entry.lazy;
+            can.set_bus_off_recovery_delay(0);
+            can.clear_periodic_frames();
+            can.clear_bridge_rules();
+            can.reset_bit_timing();
+        }
+        for (auto& entry : interfaces::uarts) {
+            auto& uart = **entry.lazy;
+            uart.reset_format();
+            uart.reset_framing();
+        }
+        uplink_integrity_ = UplinkIntegrity::NONE;
+        connecting_.store(true, std::memory_order::relaxed);
+    } else if (header.command == Command::FLOW_CONTROL) {
+        flow_control_enabled_.store(static_cast<bool>(*buffer++), std::memory_order::relaxed);
+    } else if (header.command == Command::CAN_BUS_OFF_RECOVERY) {
+        auto& config = *std::launder(reinterpret_cast<const CanBusOffRecovery*>(buffer));
+        buffer += sizeof(CanBusOffRecovery);
+        auto can = interfaces::find_can(config.can_field_id);
+        if (!can)
+            return FieldResult::INVALID;
+        can->set_bus_off_recovery_delay(config.delay);
+    } else if (header.command == Command::CAN_PERIODIC_SET) {
+        auto config = *std::launder(reinterpret_cast<const CanPeriodicSet*>(buffer));
+        buffer += sizeof(CanPeriodicSet);
+        size_t frame_size = 0;
+        if (config.period) {
+            frame_size = can::Can::downlink_field_size(buffer, sentinel - buffer);
+            if (!frame_size)
+                return FieldResult::MALFORMED;
+        }
+        auto can = interfaces::find_can(config.slot.can_field_id);
+        if (!can || config.slot.slot_index >= can::Can::periodic_slot_count) {
+            buffer += frame_size;
+            return FieldResult::INVALID;
+        }
+        can->set_periodic_frame(buffer, config.slot.slot_index, config.period, config.phase);
+    } else if (header.command == Command::CAN_PERIODIC_PATCH) {
+        auto slot = *std::launder(reinterpret_cast<const CanPeriodicSlot*>(buffer));
+        buffer += sizeof(CanPeriodicSlot);
+        // The payload length is that of the slot, so it is unknown if the slot is invalid.
+        auto can = interfaces::find_can(slot.can_field_id);
+        if (!can || slot.slot_index >= can::Can::periodic_slot_count)
+            return FieldResult::MALFORMED;
+        if (static_cast<size_t>(sentinel - buffer) < can->periodic_frame_length(slot.slot_index))
+            return FieldResult::MALFORMED;
+        if (!can->patch_periodic_frame(buffer, slot.slot_index))
+            return FieldResult::INVALID;
+    } else if (header.command == Command::CAN_BRIDGE_SET) {
+        auto config = *std::launder(reinterpret_cast<const CanBridgeSet*>(buffer));
+        buffer += sizeof(CanBridgeSet);
+        auto source = interfaces::find_can(config.source_field_id);
+        auto target = interfaces::find_can(config.target_field_id);
+        if (!source || config.rule_index >= can::Can::bridge_rule_count
+            || (!target && config.target_field_id != field::DownlinkId::CONTROL_))
+            return FieldResult::INVALID;
+        source->set_bridge_rule(
+            config.rule_index, {
+                .target             = target,
+                .is_extended_can_id = config.is_extended_can_id,
+                .forward_to_host    = config.forward_to_host,
+                .match_id           = config.match_id,
+                .match_mask         = config.match_mask,
+                .rewrite_id         = config.rewrite_id,
+                .rewrite_mask       = config.rewrite_mask,
+            });
+    } else if (header.command == Command::CAN_BIT_TIMING) {
+        auto config = *std::launder(reinterpret_cast<const CanBitTiming*>(buffer));
+        buffer += sizeof(CanBitTiming);
+        auto can = interfaces::find_can(config.can_field_id);
+        if (!can || !can->set_bit_timing(config.bitrate, config.sample_point))
+            return FieldResult::INVALID;
+    } else if (header.command == Command::UART_FORMAT) {
+        auto config = *std::launder(reinterpret_cast<const UartFormat*>(buffer));
+        buffer += sizeof(UartFormat);
+        auto uart = interfaces::find_uart(config.uart_field_id);
+        if (!uart
+            || !uart->set_format(
+                config.baud_rate, config.data_bits, config.parity, config.stop_bits))
+            return FieldResult::INVALID;
+    } else if (header.command == Command::UART_FRAMING) {
+        auto config = *std::launder(reinterpret_cast<const UartFraming*>(buffer));
+        buffer += sizeof(UartFraming);
+        auto uart = interfaces::find_uart(config.uart_field_id);
+        if (!uart || !uart->set_framing(config.mode, config.size, config.delimiter, config.latency))
+            return FieldResult::INVALID;
+    } else if (header.command == Command::UPLINK_INTEGRITY) {
+        if (!set_uplink_integrity(static_cast<UplinkIntegrity>(*buffer++)))
+            return FieldResult::INVALID;
+    } else if (header.command == Command::UART_REFEREE_FILTER) {
+        auto config = *std::launder(reinterpret_cast<const UartRefereeFilter*>(buffer));
+        buffer += sizeof(UartRefereeFilter);
+        auto uart = interfaces::find_uart(config.uart_field_id);
+        if (!uart || !uart->set_referee_filter(config.slot_index, config.command_id))
+            return FieldResult::INVALID;
+    }
+
+    return FieldResult::FORWARDED;
+}
+
+// Forward the downlink field at iterator, which is size bytes or malformed if size is 0.
+template <typename Lazy>
+inline Cdc::FieldResult
+    forward_downlink_field(Lazy& target, std::byte*& iterator, size_t size, bool flow_control) {
+    using FieldResult = Cdc::FieldResult;
+
+    if (!size)
+        return FieldResult::MALFORMED;
+    if (flow_control && !target->device_writeable(iterator))
+        return FieldResult::BLOCKED;
+    target->read_buffer_write_device(iterator);
+    return FieldResult::FORWARDED;
+}
+
+template <auto lazy>
+inline Cdc::FieldResult
+    parse_can_field(std::byte*& iterator, const std::byte* sentinel, bool flow_control) {
+    return forward_downlink_field(
+        *lazy, iterator, can::Can::downlink_field_size(iterator, sentinel - iterator),
+        flow_control);
+}
+
+template <auto lazy>
+inline Cdc::FieldResult
+    parse_uart_field(std::byte*& iterator, const std::byte* sentinel, bool flow_control) {
+    auto& target = *lazy;
+    if (target->format_pending())
+        return Cdc::FieldResult::BLOCKED;
+
+    size_t size = uart::Uart::downlink_field_size(iterator, sentinel - iterator);
+    if (size_t length = size ? uart::Uart::stream_length(iterator) : 0) {
+        // The data is consumed by parse_downlink_fields as it arrives.
+        iterator += size;
+        cdc->stream_target_    = target.get();
+        cdc->stream_remaining_ = length;
+        return Cdc::FieldResult::FORWARDED;
+    }
+    return forward_downlink_field(target, iterator, size, flow_control);
+}
+
+// Parse the downlink field at iterator, which must not extend past sentinel.
+inline Cdc::FieldResult
+    parse_downlink_field(std::byte*& iterator, const std::byte* sentinel, bool flow_control) {
+    using FieldResult = Cdc::FieldResult;
+    using Parser      = FieldResult (*)(std::byte*&, const std::byte*, bool);
+
+    // One parser per 4-bit field id, bound to the interface objects at compile time.
+    static constexpr auto parsers = [] {
+        std::array<Parser, 16> table{};
+        table.fill([](std::byte*&, const std::byte*, bool) { return FieldResult::UNKNOWN; });
+
+        table[static_cast<size_t>(field::DownlinkId::CONTROL_)] =
+            [](std::byte*& buffer, const std::byte* end, bool) {
+                return cdc->read_control_field(buffer, end);
+            };
+        [&table]<size_t... i>(std::index_sequence<i...>) {
+            ((table[static_cast<size_t>(interfaces::cans[i].downlink_id)] =
+                  &parse_can_field<interfaces::cans[i].lazy>),
+             ...);
+        }(std::make_index_sequence<interfaces::cans.size()>{});
+        [&table]<size_t... i>(std::index_sequence<i...>) {
+            ((table[static_cast<size_t>(interfaces::uarts[i].downlink_id)] =
+                  &parse_uart_field<interfaces::uarts[i].lazy>),
+             ...);
+        }(std::make_index_sequence<interfaces::uarts.size()>{});
+
+        return table;
+    }();
+
+    auto field_id = static_cast<uint8_t>(*iterator) & 0xF;
+    return parsers[field_id](iterator, sentinel, flow_control);
+}
+
+// Parse downlink fields in range [iterator, sentinel), counting malformed ones.
+// When flow control is enabled, parsing stops in front of the first field whose target queue is
+// full and false is returned, with the iterator pointing to that field. The same happens to UART
+// fields queued behind a format change of their UART.
+inline bool parse_downlink_fields(std::byte*& iterator, std::byte* sentinel, bool flow_control) {
+    using FieldResult = Cdc::FieldResult;
 
-    auto sentinel = iterator + *length;
-    assert(*iterator == std::byte{0x81});
-    iterator++;
+    // A field wrapped as {LENGTH_PREFIXED_ header, length byte, field} is skipped as a whole if the
+    // field is unknown or malformed, allowing newer hosts to send fields older firmware ignores.
+    struct __attribute__((packed)) LengthPrefix {
+        uint8_t field_id : 4; // DownlinkId::LENGTH_PREFIXED_
+        uint8_t reserved : 4;
+        uint8_t length;
+    };
+
+    auto& errors = cdc->downlink_errors_;
 
     while (iterator < sentinel) {
-        struct __attribute__((packed)) Header {
-            field::DownlinkId field_id : 4;
-        };
-        auto field_id = std::launder(reinterpret_cast<Header*>(iterator))->field_id;
-
-        if (field_id == field::DownlinkId::CONTROL_) {
-            cdc->read_control_field(iterator);
-        } else if (field_id == field::DownlinkId::CAN1_) {
-            can::can1->read_buffer_write_device(iterator);
-        } else if (field_id == field::DownlinkId::CAN2_) {
-            can::can2->read_buffer_write_device(iterator);
-        } else if (field_id == field::DownlinkId::UART1_) {
-            uart::uart1->read_buffer_write_device(iterator);
-        } else if (field_id == field::DownlinkId::UART2_) {
-            uart::uart2->read_buffer_write_device(iterator);
-        } else if (field_id == field::DownlinkId::UART3_) {
-            uart::uart_dbus->read_buffer_write_device(iterator);
-        } else
+        if (cdc->stream_remaining_) {
+            size_t size = std::min<size_t>(cdc->stream_remaining_, sentinel - iterator);
+            size_t written = cdc->stream_target_->write_stream(iterator, size);
+            if (flow_control) {
+                iterator += written;
+                cdc->stream_remaining_ -= written;
+                if (written < size)
+                    return false;
+            } else {
+                iterator += size;
+                cdc->stream_remaining_ -= size;
+                if (written < size) [[unlikely]]
+                    led::led->downlink_buffer_full();
+            }
+            continue;
+        }
+
+        auto field_iterator = iterator;
+        auto field_sentinel = sentinel;
+
+        bool length_prefixed = (static_cast<uint8_t>(*iterator) & 0xF)
+                            == static_cast<uint8_t>(field::DownlinkId::LENGTH_PREFIXED_);
+        if (length_prefixed) {
+            auto& prefix = *std::launder(reinterpret_cast<const LengthPrefix*>(iterator));
+            if (static_cast<size_t>(sentinel - iterator) < sizeof(LengthPrefix)
+                || static_cast<size_t>(sentinel - iterator) - sizeof(LengthPrefix) < prefix.length
+                || !prefix.length) {
+                errors.malformed_field++;
+                break;
+            }
+            field_iterator += sizeof(LengthPrefix);
+            field_sentinel  = field_iterator + prefix.length;
+        }
+
+        auto result = parse_downlink_field(field_iterator, field_sentinel, flow_control);
+        if (result == FieldResult::BLOCKED)
+            return false;
+
+        if (result == FieldResult::INVALID)
+            errors.invalid_argument++;
+        else if (result == FieldResult::MALFORMED)
+            errors.malformed_field++;
+        else if (result == FieldResult::UNKNOWN)
+            errors.unknown_field++;
+
+        if (length_prefixed) {
+            // Trailing bytes of a wrapped field are skipped too, so known fields may be extended.
+            iterator = field_sentinel;
+        } else if (result == FieldResult::MALFORMED || result == FieldResult::UNKNOWN) {
+            // The size of the field is unknown, the rest of the packet can not be trusted.
             break;
+        } else {
+            iterator = field_iterator;
+        }
     }
-    assert(iterator == sentinel); // TODO
 
-    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, buffer);
+    iterator = sentinel;
+    return true;
+}
+
+inline void rearm_receive(std::byte* buffer) {
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, reinterpret_cast<uint8_t*>(buffer));
     USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+}
+
+// NOLINTNEXTLINE(readability-non-const-parameter) because bullshit HAL api.
+inline int8_t hal_cdc_receive_callback(uint8_t* buffer, uint32_t* length) {
+    auto in      = cdc->receive_in_.load(std::memory_order::relaxed);
+    auto& packet = Cdc::receive_packets_[in & Cdc::receive_packet_mask];
+    assert(reinterpret_cast<std::byte*>(buffer) == packet.data);
+
+    packet.length = *length;
+    logger::trace::write(logger::trace::Event::USB_RECEIVED, 0, *length);
+    std::atomic_signal_fence(std::memory_order_release);
+    cdc->receive_in_.store(++in, std::memory_order::relaxed);
+    event::signal(event::USB_RECEIVE);
+
+    // Leave the OUT endpoint NAKed when no packet is free, the host will back off until the main
+    // loop has parsed one and re-arms reception.
+    if (in - cdc->receive_out_.load(std::memory_order::relaxed) < Cdc::receive_packet_count)
+        rearm_receive(Cdc::receive_packets_[in & Cdc::receive_packet_mask].data);
+    else
+        cdc->receive_stalled_.store(true, std::memory_order::relaxed);
+
     return USBD_OK;
 }
 
+bool Cdc::try_receive() {
+    timer::profiler::Scope profile{timer::profiler::Point::USB_RECEIVE};
+    bool parsed = false;
+
+    auto out = receive_out_.load(std::memory_order::relaxed);
+    while (out != receive_in_.load(std::memory_order::relaxed)) {
+        std::atomic_signal_fence(std::memory_order_acquire);
+
+        auto& packet  = receive_packets_[out & receive_packet_mask];
+        auto sentinel = packet.data + packet.length;
+        auto iterator = parse_iterator_;
+        if (!iterator) {
+            // Packets continuing streamed data start with 0x82 instead, if a regular packet arrives
+            // first the rest of the stream is abandoned.
+            iterator          = packet.data;
+            auto packet_start = packet.length ? *iterator : std::byte{0};
+            if (packet_start == std::byte{0x81}) {
+                if (stream_remaining_) [[unlikely]] {
+                    downlink_errors_.malformed_field++;
+                    stream_remaining_ = 0;
+                }
+                iterator++;
+            } else if (packet_start == std::byte{0x82} && stream_remaining_) {
+                iterator++;
+            } else [[unlikely]] {
+                downlink_errors_.invalid_packet++;
+                iterator = sentinel;
+            }
+        }
+
+        bool flow_control = flow_control_enabled_.load(std::memory_order::relaxed);
+        bool complete;
+        {
+            timer::profiler::Scope parse_profile{timer::profiler::Point::DOWNLINK_PARSE};
+            complete = parse_downlink_fields(iterator, sentinel, flow_control);
+        }
+        if (!complete) {
+            // Resumed once the target queue drains, which signals DOWNLINK.
+            parse_iterator_ = iterator;
+            break;
+        }
+        parse_iterator_ = nullptr;
+        parsed          = true;
+
+        std::atomic_signal_fence(std::memory_order_release);
+        receive_out_.store(++out, std::memory_order::relaxed);
+
+        utility::InterruptLockGuard guard;
+        if (receive_stalled_.load(std::memory_order::relaxed)) {
+            receive_stalled_.store(false, std::memory_order::relaxed);
+            rearm_receive(
+                receive_packets_[receive_in_.load(std::memory_order::relaxed) & receive_packet_mask]
+                    .data);
+        }
+    }
+
+    report_downlink_errors();
+    return parsed;
+}
+
 inline int8_t
     hal_cdc_transmit_complete_callback(uint8_t* buffer, uint32_t* length, uint8_t endpoint_num) {
+    event::signal(event::UPLINK);
     return USBD_OK;
 }
 
@@ -1,16 +1,26 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 
 #include <atomic>
 
 #include <usbd_cdc.h>
 #include <usbd_def.h>
 
+#include "app/logger/trace.hpp"
+#include "app/timer/profiler.hpp"
+#include "app/usb/field.hpp"
 #include "app/usb/interrupt_safe_buffer.hpp"
 #include "utility/assert.hpp"
+#include "utility/crc_unit.hpp"
+#include "utility/interrupt_lock.hpp"
 #include "utility/lazy.hpp"
 
+namespace uart {
+class Uart;
+} // namespace uart
+
 namespace usb {
 
 extern "C" {
@@ -26,25 +36,46 @@ public:
     InterruptSafeBuffer& get_transmit_buffer() { return transmit_buffer_; }
 
     bool try_transmit() {
+        timer::profiler::Scope profile{timer::profiler::Point::USB_TRANSMIT};
         if (!device_ready())
             return false;
 
         if (connecting_.load(std::memory_order::relaxed)) {
-            transmit_buffer_.clear();
+            apply_uplink_integrity();
             connecting_.store(false, std::memory_order::relaxed);
             std::atomic_signal_fence(std::memory_order_release);
             led::led->reset();
             return false;
         }
+        if (uplink_integrity_changed_) [[unlikely]] {
+            apply_uplink_integrity();
+            return false;
+        }
 
         auto batch = transmit_buffer_.pop_batch();
         if (!batch)
             return false;
 
         auto written_size = batch->written_size.load(std::memory_order::relaxed);
-        batch->written_size.store(1, std::memory_order::relaxed);
+        batch->written_size.store(transmit_buffer_.header_size_, std::memory_order::relaxed);
+
+        // The marker is rewritten for every batch, as the reserved header of a batch keeps the
+        // bytes of the previous integrity mode after a change.
+        if (uplink_integrity_ == UplinkIntegrity::NONE) {
+            batch->data[0] = std::byte{0xAE};
+        } else {
+            auto& header    = *std::launder(reinterpret_cast<SequencedBatchHeader*>(batch->data));
+            header.marker   = uplink_integrity_ == UplinkIntegrity::SEQUENCE ? 0xAF : 0xB0;
+            header.sequence = uplink_sequence_++;
+            if (uplink_integrity_ == UplinkIntegrity::SEQUENCE_CRC) {
+                uint32_t crc = utility::crc::crc32_unit(batch->data, written_size);
+                std::memcpy(&batch->data[written_size], &crc, sizeof(crc));
+                written_size += sizeof(crc);
+            }
+        }
 
         auto data = reinterpret_cast<uint8_t*>(batch->data);
+        logger::trace::write(logger::trace::Event::USB_TRANSMIT, 0, written_size);
 
         assert_always(
             USBD_CDC_SetTxBuffer(&hUsbDeviceFS, data, written_size) == USBD_OK
@@ -52,6 +83,24 @@ public:
         return true;
     }
 
+    // Parse the received downlink packets, re-arm USB reception if it was stalled by a full queue.
+    bool try_receive();
+
+    // Uplink batches start with 0xAE by default. With SEQUENCE they start with 0xAF and a wrapping
+    // uint16 counter instead, and with SEQUENCE_CRC with 0xB0 and the counter, and end with the
+    // CRC-32 (utility::crc::crc32) of all preceding bytes.
+    enum class UplinkIntegrity : uint8_t { NONE = 0, SEQUENCE = 1, SEQUENCE_CRC = 2 };
+
+    // Takes effect on the next batch boundary, dropping queued uplink data and restarting the
+    // counter from 0.
+    bool set_uplink_integrity(UplinkIntegrity integrity) {
+        if (integrity > UplinkIntegrity::SEQUENCE_CRC)
+            return false;
+        uplink_integrity_         = integrity;
+        uplink_integrity_changed_ = true;
+        return true;
+    }
+
 private:
     static bool device_ready() {
         // The value of cdc_handle remains null until a USB connection occurs, and an interrupt
@@ -68,22 +117,47 @@ private:
         return static_cast<USBD_CDC_HandleTypeDef*>(hal_cdc_handle)->TxState == 0U;
     }
 
-    void read_control_field(std::byte*& buffer) {
-        enum class Command : uint8_t {
-            CONNECT = 0, // Clear uplink buffer, reset alarm and configuration
-        };
-        struct __attribute__((packed)) FieldHeader {
-            uint8_t field_id : 4;
-            Command command  : 4;
-        };
-
-        auto header = std::bit_cast<FieldHeader>(*buffer++);
-        if (header.command == Command::CONNECT) {
-            connecting_.store(true, std::memory_order::relaxed);
-        } else {
-            assert(false);
-            __builtin_unreachable();
-        }
+    enum class FieldResult : uint8_t {
+        FORWARDED, // Field consumed
+        BLOCKED,   // Target queue full under flow control, nothing consumed
+        INVALID,   // Field consumed but rejected, e.g. an out of range index
+        MALFORMED, // Field truncated or inconsistent, its size is unknown
+        UNKNOWN,   // Unsupported field id or command, its size is unknown
+    };
+
+    FieldResult read_control_field(std::byte*& buffer, const std::byte* sentinel);
+
+    // Report the downlink error counters if they changed, at most every 100ms.
+    void report_downlink_errors() {
+        uint32_t tick = HAL_GetTick();
+        if (downlink_errors_ == reported_downlink_errors_ || tick - downlink_report_tick_ < 100)
+            return;
+
+        auto buffer = transmit_buffer_.allocate(sizeof(DownlinkErrorField));
+        if (!buffer)
+            return;
+
+        auto& error_field      = *new (buffer) DownlinkErrorField{};
+        error_field.field_id   = static_cast<uint8_t>(field::UplinkId::CONTROL_);
+        error_field.control_id = static_cast<uint8_t>(field::UplinkControlId::DOWNLINK_ERROR_);
+        error_field.counters   = downlink_errors_;
+
+        reported_downlink_errors_ = downlink_errors_;
+        downlink_report_tick_     = tick;
+    }
+
+    struct __attribute__((packed)) SequencedBatchHeader {
+        uint8_t marker;
+        uint16_t sequence;
+    };
+
+    void apply_uplink_integrity() {
+        utility::InterruptLockGuard guard;
+        transmit_buffer_.reserve(
+            uplink_integrity_ == UplinkIntegrity::NONE ? 1 : sizeof(SequencedBatchHeader),
+            uplink_integrity_ == UplinkIntegrity::SEQUENCE_CRC ? sizeof(uint32_t) : 0);
+        uplink_sequence_          = 0;
+        uplink_integrity_changed_ = false;
     }
 
     friend inline int8_t hal_cdc_init_callback();
@@ -91,11 +165,65 @@ private:
     friend inline int8_t hal_cdc_control_callback(uint8_t, uint8_t*, uint16_t);
     friend inline int8_t hal_cdc_receive_callback(uint8_t*, uint32_t*);
     friend inline int8_t hal_cdc_transmit_complete_callback(uint8_t*, uint32_t*, uint8_t);
+    template <typename Lazy>
+    friend inline FieldResult forward_downlink_field(Lazy&, std::byte*&, size_t, bool);
+    template <auto lazy>
+    friend inline FieldResult parse_can_field(std::byte*&, const std::byte*, bool);
+    template <auto lazy>
+    friend inline FieldResult parse_uart_field(std::byte*&, const std::byte*, bool);
+    friend inline FieldResult parse_downlink_field(std::byte*&, const std::byte*, bool);
+    friend inline bool parse_downlink_fields(std::byte*&, std::byte*, bool);
+
+    // OUT packets are received in the USB interrupt and parsed by the main loop. The endpoint is
+    // re-armed with the next free packet right away, and stays NAKed while all of them are pending.
+    static constexpr size_t receive_packet_count = 4;
+    static constexpr size_t receive_packet_mask  = receive_packet_count - 1;
+    static_assert((receive_packet_count & receive_packet_mask) == 0);
+
+    // Padded as CAN fields are always read with 8 data bytes, see Can::construct_mailbox_data.
+    struct ReceivePacket {
+        alignas(size_t) std::byte data[64 + 7];
+        size_t length;
+    };
+    inline static constinit ReceivePacket receive_packets_[receive_packet_count]{};
+    std::atomic<size_t> receive_in_    = 0;
+    std::atomic<size_t> receive_out_   = 0;
+    std::atomic<bool> receive_stalled_ = false;
 
-    alignas(size_t) inline static constinit std::byte receive_buffer_[64];
     InterruptSafeBuffer transmit_buffer_{};
 
     std::atomic<bool> connecting_;
+
+    // Only accessed by the main loop.
+    UplinkIntegrity uplink_integrity_ = UplinkIntegrity::NONE;
+    bool uplink_integrity_changed_    = false;
+    uint16_t uplink_sequence_         = 0;
+
+    // When flow control is enabled, parsing stops in front of a field whose target queue is full
+    // instead of dropping it, and resumes from parse_iterator_ on the next call.
+    std::atomic<bool> flow_control_enabled_ = false;
+    std::byte* parse_iterator_              = nullptr;
+
+    // Streamed UART data still expected at the start of the following packets.
+    uart::Uart* stream_target_ = nullptr;
+    size_t stream_remaining_   = 0;
+
+    struct __attribute__((packed)) DownlinkErrorField {
+        uint8_t field_id   : 4; // UplinkId::CONTROL_
+        uint8_t control_id : 4; // UplinkControlId::DOWNLINK_ERROR_
+
+        // Wrapping counters of dropped downlink data.
+        struct __attribute__((packed)) Counters {
+            uint16_t invalid_packet;   // Packets not starting with 0x81 (or 0x82 when streaming)
+            uint16_t malformed_field;  // Fields dropped with the rest of their packet
+            uint16_t unknown_field;    // Unsupported fields, skipped if length prefixed
+            uint16_t invalid_argument; // Fields rejected by their target
+
+            bool operator==(const Counters&) const = default;
+        } counters;
+    };
+    DownlinkErrorField::Counters downlink_errors_{}, reported_downlink_errors_{};
+    uint32_t downlink_report_tick_ = 0;
 };
 
 inline constinit Cdc::Lazy cdc;
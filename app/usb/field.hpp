@@ -26,6 +26,15 @@ enum class UplinkId : uint8_t {
     UART6_ = 10,
 
     IMU_ = 11,
+
+    DBUS_ = 12, // Decoded remote frames of the DBUS UART, see uart::dbus
+};
+
+// Uplink CONTROL_ fields store one of these ids in the 4 bits following the field id.
+enum class UplinkControlId : uint8_t {
+    CAN_STATUS_          = 0,
+    CAN_TRANSMIT_FAILED_ = 1,
+    DOWNLINK_ERROR_      = 2,
 };
 
 enum class DownlinkId : uint8_t {
@@ -46,6 +55,9 @@ enum class DownlinkId : uint8_t {
 
     LED_    = 11,
     BUZZER_ = 12,
+
+    // Followed by a length byte and a field of that length, which is skipped if unsupported.
+    LENGTH_PREFIXED_ = 15,
 };
 
 } // namespace usb::field
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <atomic>
 #include <bit>
 
+#include "app/event.hpp"
 #include "app/led/led.hpp"
 #include "utility/assert.hpp"
 #include "utility/immovable.hpp"
@@ -20,6 +21,9 @@ public:
     static constexpr size_t batch_count = 8;
     static_assert(std::has_single_bit(batch_count), "Batch count must be a power of 2");
 
+    // Upper bound of the bytes reserved by the batch header and trailer, see reserve.
+    static constexpr size_t max_reserved_size = 8;
+
     constexpr InterruptSafeBuffer() {
         for (auto& batch : batches_) {
             std::byte* start_of_packet = batch.allocate(1);
@@ -38,8 +42,10 @@ public:
 
             auto readable = in - out;
             if (readable) {
-                if (auto result = batches_[(in - 1) & mask].allocate(size))
+                if (auto result = batches_[(in - 1) & mask].allocate(size, capacity_)) {
+                    event::signal(event::UPLINK);
                     return result;
+                }
             }
 
             auto writeable = batch_count - readable - 1;
@@ -52,16 +58,42 @@ public:
         }
     }
 
+    // Check whether allocating count blocks in order, of field_size(i) bytes each, would succeed.
+    // Only meaningful with interrupts disabled, so that no other producer allocates in between.
+    template <typename F>
+    bool allocatable(size_t count, F&& field_size) const {
+        auto in  = in_.load(std::memory_order::relaxed);
+        auto out = out_.load(std::memory_order::relaxed);
+
+        auto readable = in - out;
+        size_t remaining =
+            readable ? capacity_ - batches_[(in - 1) & mask].written_size.load(
+                                       std::memory_order::relaxed)
+                     : 0;
+        auto writeable = batch_count - readable - 1;
+
+        for (size_t i = 0; i < count; i++) {
+            size_t size = field_size(i);
+            if (size > remaining) {
+                if (!writeable--)
+                    return false;
+                remaining = capacity_ - header_size_;
+            }
+            remaining -= size;
+        }
+        return true;
+    }
+
 private:
     static constexpr size_t mask = batch_count - 1;
 
     struct Batch {
-        std::byte* allocate(size_t size) {
+        std::byte* allocate(size_t size, size_t capacity = batch_size) {
             size_t written_size_local;
 
             do {
                 written_size_local = written_size.load(std::memory_order::relaxed);
-                if (batch_size - written_size_local < size)
+                if (capacity - written_size_local < size)
                     return nullptr;
             } while (!written_size.compare_exchange_weak(
                 written_size_local, written_size_local + size, std::memory_order::relaxed));
@@ -81,7 +113,7 @@ private:
         if (!readable)
             return nullptr;
         auto& batch = batches_[out & mask];
-        if (batch.written_size.load(std::memory_order::relaxed) <= 1)
+        if (batch.written_size.load(std::memory_order::relaxed) <= header_size_)
             return nullptr;
 
         std::atomic_signal_fence(std::memory_order_release);
@@ -102,16 +134,31 @@ private:
         auto slice  = std::min(readable, batch_count - offset);
 
         for (size_t i = 0; i < slice; i++)
-            batches_[offset + i].written_size.store(1, std::memory_order::relaxed);
+            batches_[offset + i].written_size.store(header_size_, std::memory_order::relaxed);
         for (size_t i = 0; i < readable - slice; i++)
-            batches_[i].written_size.store(1, std::memory_order::relaxed);
+            batches_[i].written_size.store(header_size_, std::memory_order::relaxed);
 
         std::atomic_signal_fence(std::memory_order_release);
         out_.store(in, std::memory_order::relaxed);
     }
 
+    // Reserve header_size bytes at the start of each batch, filled in by the consumer, and
+    // trailer_size bytes at its end, appended by the consumer. Queued data is dropped. Must be
+    // called with interrupts disabled, so that no allocation is in progress.
+    void reserve(size_t header_size, size_t trailer_size) {
+        assert_always(header_size && header_size + trailer_size <= max_reserved_size);
+
+        clear();
+        header_size_ = header_size;
+        capacity_    = batch_size - trailer_size;
+        for (auto& batch : batches_)
+            batch.written_size.store(header_size_, std::memory_order::relaxed);
+    }
+
     std::atomic<size_t> in_{0}, out_{0};
     Batch batches_[batch_count];
+
+    size_t header_size_ = 1, capacity_ = batch_size;
 };
 
 } // namespace usb
\ No newline at end of file
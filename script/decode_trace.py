@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Decode the binary event trace written by app/logger/trace.hpp on RTT up channel 1.
+
+Capture the channel into a file, for example with
+    JLinkRTTLogger -Device STM32F407IG -If SWD -Speed 4000 -RTTChannel 1 trace.bin
+then print the timeline with
+    python script/decode_trace.py trace.bin
+or convert it for chrome://tracing or https://ui.perfetto.dev with
+    python script/decode_trace.py trace.bin --chrome trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+SYSTEM_FREQUENCY = 168_000_000
+
+# struct Record: uint32 timestamp, uint8 event, uint8 dropped, uint16 arg0, uint32 arg1, arg2
+RECORD = struct.Struct("<IBBHII")
+
+# Keep in sync with logger::trace::Event.
+SCOPE_BEGIN, SCOPE_END, WAKE_UP, CAN_RECEIVED, UART_RECEIVED, USB_RECEIVED, USB_TRANSMIT = range(7)
+
+# Keep in sync with timer::profiler::Point, the interrupt scopes get a track each.
+POINTS = [
+    ("can_receive", True),
+    ("can_scheduler", True),
+    ("uart_interrupt", True),
+    ("imu_read", True),
+    ("usb_receive", False),
+    ("downlink_parse", False),
+    ("usb_transmit", False),
+    ("can_transmit", False),
+    ("uart_transmit", False),
+    ("main_loop", False),
+    ("event_latency", False),
+]
+
+# usb::field::UplinkId
+UPLINK_IDS = {2: "can1", 3: "can2", 4: "can3", 5: "uart1", 6: "uart2", 7: "uart3", 12: "dbus"}
+
+# event::Source
+SOURCES = ["usb_receive", "uplink", "downlink", "tick"]
+
+
+def point_name(index):
+    return POINTS[index][0] if index < len(POINTS) else f"point{index}"
+
+
+def describe(event, arg0, arg1, arg2):
+    """Return (name, track, details) of a non-scope record."""
+    if event == WAKE_UP:
+        sources = [name for bit, name in enumerate(SOURCES) if arg1 >> bit & 1]
+        return "wake_up", "main", {"sources": "|".join(sources)}
+    if event == CAN_RECEIVED:
+        bus = UPLINK_IDS.get(arg0, str(arg0))
+        extended = bool(arg1 & 0b100)
+        can_id = arg1 >> 3 if extended else arg1 >> 21
+        details = {
+            "id": f"0x{can_id:0{8 if extended else 3}X}",
+            "dlc": arg2 & 0xF,
+            "rtr": bool(arg1 & 0b10),
+        }
+        return "can_received", bus, details
+    if event == UART_RECEIVED:
+        details = {"size": arg1, "uplinked": bool(arg2)}
+        return "uart_received", UPLINK_IDS.get(arg0, str(arg0)), details
+    if event == USB_RECEIVED:
+        return "usb_received", "usb", {"size": arg1}
+    if event == USB_TRANSMIT:
+        return "usb_transmit", "usb", {"size": arg1}
+    return f"event{event}", "unknown", {"arg0": arg0, "arg1": arg1, "arg2": arg2}
+
+
+def read_records(data):
+    """Yield (time in seconds, event, dropped, arg0, arg1, arg2), unwrapping the cycle counter.
+
+    Records are stored in reservation order, and an interrupt preempting a writer between its
+    timestamp and its reservation stores a later record first. The delta to the previous record
+    is therefore signed, and gaps of more than 12.8s between two records can not be detected.
+    """
+    usable = len(data) - len(data) % RECORD.size
+    if usable != len(data):
+        print(f"warning: ignoring {len(data) - usable} trailing bytes", file=sys.stderr)
+
+    previous, cycles = None, 0
+    for offset in range(0, usable, RECORD.size):
+        timestamp, event, dropped, arg0, arg1, arg2 = RECORD.unpack_from(data, offset)
+        if previous is not None:
+            delta = (timestamp - previous) & 0xFFFFFFFF
+            cycles += delta - (1 << 32) if delta >> 31 else delta
+        previous = timestamp
+        yield cycles / SYSTEM_FREQUENCY, event, dropped, arg0, arg1, arg2
+
+
+def print_timeline(records):
+    for time, event, dropped, arg0, arg1, arg2 in records:
+        if dropped:
+            saturated = "+" if dropped == 255 else ""
+            print(f"{time * 1e6:14.3f}us  -- {dropped}{saturated} records dropped")
+        if event in (SCOPE_BEGIN, SCOPE_END):
+            marker = "begin" if event == SCOPE_BEGIN else "end"
+            print(f"{time * 1e6:14.3f}us  {point_name(arg0)} {marker}")
+        else:
+            name, track, details = describe(event, arg0, arg1, arg2)
+            arguments = " ".join(f"{key}={value}" for key, value in details.items())
+            print(f"{time * 1e6:14.3f}us  {name} [{track}] {arguments}")
+
+
+def write_chrome_trace(records, output):
+    trace = []
+    for time, event, dropped, arg0, arg1, arg2 in records:
+        timestamp = time * 1e6
+        if dropped:
+            trace.append(
+                {"name": "dropped", "ph": "i", "s": "g", "ts": timestamp, "pid": 0, "tid": "trace",
+                 "args": {"count": dropped}})
+        if event in (SCOPE_BEGIN, SCOPE_END):
+            interrupt = arg0 < len(POINTS) and POINTS[arg0][1]
+            trace.append({
+                "name": point_name(arg0),
+                "ph": "B" if event == SCOPE_BEGIN else "E",
+                "ts": timestamp,
+                "pid": 0,
+                "tid": point_name(arg0) if interrupt else "main",
+            })
+        else:
+            name, track, details = describe(event, arg0, arg1, arg2)
+            trace.append(
+                {"name": name, "ph": "i", "s": "t", "ts": timestamp, "pid": 0, "tid": track,
+                 "args": details})
+    json.dump({"traceEvents": trace, "displayTimeUnit": "ns"}, output)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", type=argparse.FileType("rb"), help="raw capture of RTT channel 1")
+    parser.add_argument(
+        "--chrome", type=argparse.FileType("w"), metavar="OUTPUT",
+        help="write a Chrome trace event file instead of printing the timeline")
+    args = parser.parse_args()
+
+    records = read_records(args.input.read())
+    if args.chrome:
+        write_chrome_trace(records, args.chrome)
+    else:
+        print_timeline(records)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+#include "utility/crc.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <array>
+
+// Compile time checks of the software CRCs: the catalogue check values over "123456789", and
+// slice-by-4 against the byte-wise CRC-32 for every length, start offset and chaining split.
+// The hardware unit variant is checked and all variants are timed at startup, see crc_unit.cpp.
+
+namespace utility::crc {
+namespace {
+
+consteval std::array<std::byte, 9> check_input() {
+    std::array<std::byte, 9> input{};
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = static_cast<std::byte>('1' + i);
+    return input;
+}
+
+constexpr auto input = check_input();
+
+static_assert(crc32(input.data(), input.size()) == 0xCBF43926);
+static_assert(crc32_slice4(input.data(), input.size()) == 0xCBF43926);
+static_assert(crc16(input.data(), input.size()) == 0x6F91);
+// CRC-8/MAXIM is catalogued with an initial value of 0, the referee system uses 0xFF.
+static_assert(crc8(input.data(), input.size(), 0x00) == 0xA1);
+
+consteval bool slice4_matches_bytewise() {
+    std::array<std::byte, 40> data{};
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<std::byte>(i * 151 + 7);
+
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t size = 0; offset + size <= data.size(); size++) {
+            auto begin    = data.data() + offset;
+            auto expected = crc32(begin, size);
+            if (crc32_slice4(begin, size) != expected)
+                return false;
+
+            for (size_t split = 0; split <= size; split++) {
+                auto first = crc32_slice4(begin, split);
+                if (crc32_slice4(begin + split, size - split, first) != expected
+                    || crc32(begin + split, size - split, crc32(begin, split)) != expected)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(slice4_matches_bytewise());
+
+} // namespace
+} // namespace utility::crc
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <array>
+
+namespace utility::crc {
+
+// Lookup table of a reflected (LSB first) CRC, one entry per byte value.
+template <typename T>
+constexpr std::array<T, 256> make_reflected_table(T polynomial) {
+    std::array<T, 256> table{};
+    for (size_t byte = 0; byte < 256; byte++) {
+        T crc = static_cast<T>(byte);
+        for (int bit = 0; bit < 8; bit++)
+            crc = static_cast<T>(crc & 1 ? (crc >> 1) ^ polynomial : crc >> 1);
+        table[byte] = crc;
+    }
+    return table;
+}
+
+// Tables for slicing by N bytes: tables[k][byte] is the CRC of byte followed by k zero bytes.
+template <typename T, size_t n>
+constexpr std::array<std::array<T, 256>, n> make_slice_tables(T polynomial) {
+    std::array<std::array<T, 256>, n> tables{};
+    tables[0] = make_reflected_table<T>(polynomial);
+    for (size_t k = 1; k < n; k++)
+        for (size_t byte = 0; byte < 256; byte++)
+            tables[k][byte] = static_cast<T>(
+                (tables[k - 1][byte] >> 8) ^ tables[0][tables[k - 1][byte] & 0xFF]);
+    return tables;
+}
+
+inline constexpr auto crc8_table   = make_reflected_table<uint8_t>(0x8C);
+inline constexpr auto crc16_table  = make_reflected_table<uint16_t>(0x8408);
+inline constexpr auto crc32_tables = make_slice_tables<uint32_t, 4>(0xEDB88320);
+
+// CRC-8/MAXIM polynomial with an initial value of 0xFF, as used by the RoboMaster referee system
+// frame header. Pass the previous result as crc to continue over further data.
+constexpr uint8_t crc8(const std::byte* data, size_t size, uint8_t crc = 0xFF) {
+    while (size--)
+        crc = crc8_table[crc ^ static_cast<uint8_t>(*data++)];
+    return crc;
+}
+
+// CRC-16/MCRF4XX (CCITT polynomial, reflected, initial value 0xFFFF), as used by the RoboMaster
+// referee system frame tail.
+constexpr uint16_t crc16(const std::byte* data, size_t size, uint16_t crc = 0xFFFF) {
+    while (size--)
+        crc = static_cast<uint16_t>(
+            (crc >> 8) ^ crc16_table[(crc ^ static_cast<uint8_t>(*data++)) & 0xFF]);
+    return crc;
+}
+
+// CRC-32/ISO-HDLC, as used by zlib and Ethernet. The pre and post inversion is done internally,
+// so the previous result can be passed as crc to continue over further data.
+constexpr uint32_t crc32(const std::byte* data, size_t size, uint32_t crc = 0) {
+    crc = ~crc;
+    while (size--)
+        crc = (crc >> 8) ^ crc32_tables[0][(crc ^ static_cast<uint8_t>(*data++)) & 0xFF];
+    return ~crc;
+}
+
+// Same result as crc32, processing 4 bytes per table round with 4KiB of tables instead of 1KiB.
+constexpr uint32_t crc32_slice4(const std::byte* data, size_t size, uint32_t crc = 0) {
+    crc = ~crc;
+    for (; size >= 4; size -= 4, data += 4) {
+        crc ^= static_cast<uint32_t>(data[0]) | static_cast<uint32_t>(data[1]) << 8
+             | static_cast<uint32_t>(data[2]) << 16 | static_cast<uint32_t>(data[3]) << 24;
+        crc = crc32_tables[3][crc & 0xFF] ^ crc32_tables[2][(crc >> 8) & 0xFF]
+            ^ crc32_tables[1][(crc >> 16) & 0xFF] ^ crc32_tables[0][crc >> 24];
+    }
+    return crc32(data, size, ~crc);
+}
+
+} // namespace utility::crc
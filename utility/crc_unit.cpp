@@ -0,0 +1,59 @@
+#include "utility/crc_unit.hpp"
+
+#include <iterator>
+
+#include "utility/assert.hpp"
+
+#ifdef APP_PROFILER
+#include "app/logger/logger.hpp"
+#endif
+
+namespace utility::crc {
+
+void self_check() {
+    constexpr char input[] = "123456789";
+    constexpr size_t size  = std::size(input) - 1;
+    auto data              = reinterpret_cast<const std::byte*>(input);
+
+    auto expected = crc32(data, size);
+    assert_always(expected == 0xCBF43926);
+    assert_always(crc32_unit(data, size) == expected);
+    for (size_t split = 0; split <= size; split++)
+        assert_always(crc32_unit(data + split, size - split, crc32_unit(data, split)) == expected);
+}
+
+#ifdef APP_PROFILER
+
+// Called before interrupts are enabled, each variant is timed on a second, warmed up run.
+void report_benchmark() {
+    static constinit std::byte data[1024];
+    for (size_t i = 0; i < std::size(data); i++)
+        data[i] = static_cast<std::byte>(i * 151 + 7);
+
+    using Crc = uint32_t (*)(const std::byte*, size_t, uint32_t);
+    auto hundredths_per_byte = [](Crc crc, size_t size) {
+        uint32_t cycles = 0;
+        for (int run = 0; run < 2; run++) {
+            auto start               = DWT->CYCCNT;
+            volatile uint32_t result = crc(data, size, 0);
+            cycles                   = DWT->CYCCNT - start;
+            (void)result;
+        }
+        return static_cast<unsigned>(cycles * 100 / size);
+    };
+    auto print = [](const char* name, unsigned hundredths) {
+        logger::logger->printf(" %s %u.%02u", name, hundredths / 100, hundredths % 100);
+    };
+
+    for (size_t size : {size_t{64}, std::size(data)}) {
+        logger::logger->printf("crc32 cycles per byte over %u bytes:", static_cast<unsigned>(size));
+        print("bytewise", hundredths_per_byte(crc32, size));
+        print("slice4", hundredths_per_byte(crc32_slice4, size));
+        print("unit", hundredths_per_byte(crc32_unit, size));
+        logger::logger->printf("\n");
+    }
+}
+
+#endif
+
+} // namespace utility::crc
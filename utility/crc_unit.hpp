@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <main.h>
+
+#include "utility/crc.hpp"
+
+namespace utility::crc {
+
+// Same result as crc32, using the CRC calculation unit for whole words and the table for the
+// trailing bytes. The unit computes CRC-32/MPEG-2 (MSB first, initial value 0xFFFFFFFF), so words
+// are bit reversed on the way in and the result on the way out, and the previous result is folded
+// into the first word in place of an initial value.
+// The unit holds the running state, so this must not be called from more than one priority level.
+inline uint32_t crc32_unit(const std::byte* data, size_t size, uint32_t crc = 0) {
+    if (size < 4)
+        return crc32(data, size, crc);
+
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->CR = CRC_CR_RESET;
+
+    uint32_t word;
+    std::memcpy(&word, data, sizeof(word));
+    CRC->DR = __RBIT(word ^ crc);
+    for (data += 4, size -= 4; size >= 4; data += 4, size -= 4) {
+        std::memcpy(&word, data, sizeof(word));
+        CRC->DR = __RBIT(word);
+    }
+
+    return crc32(data, size, ~__RBIT(CRC->DR));
+}
+
+// Assert that crc32_unit matches crc32 on the check input, split at every offset so that both the
+// word and the trailing byte paths run from unaligned starts. Called once at startup.
+void self_check();
+
+#ifdef APP_PROFILER
+// Print the cycles per byte of the CRC-32 variants, over an uplink batch and a larger block.
+void report_benchmark();
+#else
+inline void report_benchmark() {}
+#endif
+
+} // namespace utility::crc
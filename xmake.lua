@@ -9,6 +9,20 @@ set_config("plat", "cross")           -- 交叉编译
 set_config("cross", "arm-none-eabi-") -- 设置交叉编译平台
 set_toolchains("gnu-rm")              -- 使用gnu-arm工具链
 
+-- 使用 xmake f --profiler=y 启用基于DWT周期计数器的热点路径性能统计，结果通过RTT通道0输出
+option("profiler", function()
+    set_default(false)
+    set_showmenu(true)
+    add_defines("APP_PROFILER")
+end)
+
+-- 使用 xmake f --trace=y 启用二进制事件追踪，通过RTT通道1输出，由 script/decode_trace.py 解码
+option("trace", function()
+    set_default(false)
+    set_showmenu(true)
+    add_defines("APP_TRACE")
+end)
+
 target("application", function(t)
     local version = "2.1.2"
     set_version(version)
@@ -50,6 +64,8 @@ target("application", function(t)
     -- 对于gcc编译器，需要加一句-pedantic-errors禁用所有GNU扩展
     add_cxflags("-pedantic-errors")
 
+    add_options("profiler", "trace")
+
     -- 定义HAL库相关的宏
     add_defines("USE_HAL_DRIVER", "STM32F407xx")
 